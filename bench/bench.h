@@ -0,0 +1,73 @@
+/*  monero-update - An downloaded/checker updater for Monero
+ *
+ *  Copyright (c) 2019, The Monero Project
+ *
+ *  All rights reserved.
+ *
+ *  monero-update is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  monero-update is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with monero-update.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <chrono>
+#include <string>
+
+namespace bench
+{
+  typedef std::chrono::steady_clock clock;
+
+  //! Runs `f` `iterations` times, and returns the average time per run in ns
+  template<typename F>
+  double time_per_run(size_t iterations, F f)
+  {
+    const clock::time_point start = clock::now();
+    for (size_t i = 0; i < iterations; ++i)
+      f();
+    return std::chrono::duration<double, std::nano>(clock::now() - start).count() / iterations;
+  }
+
+  inline double seconds_since(clock::time_point start)
+  {
+    return std::chrono::duration<double>(clock::now() - start).count();
+  }
+
+  //! number of times operator new was called so far
+  uint64_t get_allocations();
+
+  inline void report(const std::string &name, double ns)
+  {
+    if (ns >= 1e9)
+      printf("  %-56s %10.2f s\n", name.c_str(), ns / 1e9);
+    else if (ns >= 1e6)
+      printf("  %-56s %10.2f ms\n", name.c_str(), ns / 1e6);
+    else if (ns >= 1e3)
+      printf("  %-56s %10.2f us\n", name.c_str(), ns / 1e3);
+    else
+      printf("  %-56s %10.1f ns\n", name.c_str(), ns);
+  }
+
+  inline void report_throughput(const std::string &name, uint64_t bytes, double seconds)
+  {
+    printf("  %-56s %10.1f MB/s\n", name.c_str(), bytes / seconds / 1e6);
+  }
+}
+
+// one per benchmark, they return an exit code
+int bench_ssl_context(int argc, char **argv);
+int bench_chunked(int argc, char **argv);
+int bench_headers(int argc, char **argv);
+int bench_recv(int argc, char **argv);
+int bench_file_write(int argc, char **argv);
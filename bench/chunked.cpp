@@ -0,0 +1,96 @@
+/*  monero-update - An downloaded/checker updater for Monero
+ *
+ *  Copyright (c) 2019, The Monero Project
+ *
+ *  All rights reserved.
+ *
+ *  monero-update is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  monero-update is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with monero-update.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include "net/http_client.h"
+#include "fake_net_client.h"
+#include "bench.h"
+
+using namespace bench;
+
+namespace
+{
+  // counts the body rather than keeping it
+  class counting_client: public epee::net_utils::http::http_simple_client_template<fake_net_client>
+  {
+  public:
+    counting_client(): body_size(0) {}
+    virtual bool handle_target_data(epee::span<const char> piece_of_transfer)
+    {
+      body_size += piece_of_transfer.size();
+      return true;
+    }
+    uint64_t body_size;
+  };
+
+  std::string make_chunked_response(uint64_t body_size, size_t chunk_size)
+  {
+    std::string response = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n";
+    const std::string chunk(chunk_size, 'x');
+    char head[32];
+    for (uint64_t left = body_size; left > 0; )
+    {
+      const size_t size = std::min<uint64_t>(chunk_size, left);
+      snprintf(head, sizeof(head), "%zx\r\n", size);
+      response += head;
+      response.append(chunk, 0, size);
+      response += "\r\n";
+      left -= size;
+    }
+    response += "0\r\n\r\n";
+    return response;
+  }
+
+  bool run(const std::string &name, const std::string &response, uint64_t body_size, size_t iterations)
+  {
+    counting_client client;
+    bool ok = true;
+    const clock::time_point start = clock::now();
+    for (size_t i = 0; i < iterations; ++i)
+    {
+      client.body_size = 0;
+      ok = client.test(response, std::chrono::seconds(10)) && client.body_size == body_size && ok;
+    }
+    if (!ok)
+    {
+      printf("  %s: failed to decode\n", name.c_str());
+      return false;
+    }
+    report_throughput(name, body_size * iterations, seconds_since(start));
+    return true;
+  }
+}
+
+// Decoding chunked bodies with small and large chunks, from memory
+int bench_chunked(int argc, char **argv)
+{
+  const uint64_t body_size = (argc > 0 ? strtoull(argv[0], NULL, 10) : 16) << 20;
+  const size_t iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 5;
+
+  printf("Chunked bodies of %llu MB, up to %zu bytes per read\n", (unsigned long long)(body_size >> 20), fake_net_client::get_read_size());
+  bool ok = true;
+  for (size_t chunk_size: {16, 256, 4096, 65536, 1048576})
+    ok = run("chunks of " + std::to_string(chunk_size) + " bytes", make_chunked_response(body_size, chunk_size), body_size, iterations) && ok;
+  const std::string content_length = "HTTP/1.1 200 OK\r\nContent-Length: " + std::to_string(body_size) + "\r\n\r\n" + std::string(body_size, 'x');
+  ok = run("Content-Length, for comparison", content_length, body_size, iterations) && ok;
+  return ok ? 0 : 1;
+}
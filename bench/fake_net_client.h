@@ -0,0 +1,80 @@
+/*  monero-update - An downloaded/checker updater for Monero
+ *
+ *  Copyright (c) 2019, The Monero Project
+ *
+ *  All rights reserved.
+ *
+ *  monero-update is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  monero-update is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with monero-update.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <boost/asio/buffer.hpp>
+#include "net/net_ssl.h"
+
+namespace bench
+{
+  // Stands in for blocked_mode_client under http_simple_client_template, so
+  // responses can be parsed from memory with http_simple_client_template::test.
+  // Each read returns at most `get_read_size()` bytes, as a socket would.
+  class fake_net_client
+  {
+  public:
+    fake_net_client(): data(NULL), position(0), bytes_received(0) {}
+
+    //! `s` must be kept alive until it has been read
+    void set_test_data(const std::string &s) { data = &s; position = 0; }
+    //! for all clients, as the HTTP client does not give access to its own
+    static size_t &get_read_size() { static size_t read_size = 65536; return read_size; }
+
+    bool recv(char *buff, size_t max_size, size_t &received, std::chrono::milliseconds timeout)
+    {
+      received = std::min(std::min(max_size, get_read_size()), data->size() - position);
+      memcpy(buff, data->data() + position, received);
+      position += received;
+      bytes_received += received;
+      return true;
+    }
+
+    template<typename MutableBufferSequence>
+    bool recv(const MutableBufferSequence &buffers, size_t &received, std::chrono::milliseconds timeout)
+    {
+      const size_t size = std::min(std::min(boost::asio::buffer_size(buffers), get_read_size()), data->size() - position);
+      received = boost::asio::buffer_copy(buffers, boost::asio::buffer(data->data() + position, size));
+      position += received;
+      bytes_received += received;
+      return true;
+    }
+
+    bool connect(const std::string &addr, const std::string &port, std::chrono::milliseconds timeout) { return true; }
+    bool disconnect() { return true; }
+    bool is_connected(bool *ssl = NULL) { return data && position < data->size(); }
+    bool send(const std::string &buff, std::chrono::milliseconds timeout) { return true; }
+    void set_ssl(epee::net_utils::ssl_options_t ssl_options) {}
+    void set_deadline(std::chrono::steady_clock::time_point deadline) {}
+    void interrupt() {}
+    uint64_t get_bytes_sent() const { return 0; }
+    uint64_t get_bytes_received() const { return bytes_received; }
+    std::string get_ssl_info() const { return std::string(); }
+
+  private:
+    const std::string *data;
+    size_t position;
+    uint64_t bytes_received;
+  };
+}
@@ -0,0 +1,121 @@
+/*  monero-update - An downloaded/checker updater for Monero
+ *
+ *  Copyright (c) 2019, The Monero Project
+ *
+ *  All rights reserved.
+ *
+ *  monero-update is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  monero-update is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with monero-update.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "common/download_file.h"
+#include "bench.h"
+
+using namespace bench;
+
+namespace
+{
+  const size_t piece_size = 16384; // what the HTTP client used to hand out
+
+  bool write_ofstream(const std::string &path, uint64_t size)
+  {
+    const std::string piece(piece_size, 'x');
+    std::ofstream f(path, std::ios::binary | std::ios::trunc);
+    for (uint64_t written = 0; written < size && f; written += piece_size)
+      f.write(piece.data(), piece_size);
+    f.close();
+    return !f.fail();
+  }
+
+  bool write_staged(const std::string &path, uint64_t size, bool reserve)
+  {
+    const std::string piece(piece_size, 'x');
+    tools::download_file f;
+    if (!f.open(path, true, 0))
+      return false;
+    if (reserve)
+      f.reserve(size);
+    for (uint64_t written = 0; written < size; written += piece_size)
+      if (!f.write(piece.data(), piece_size))
+        return false;
+    return f.close();
+  }
+
+  // as when the body is read straight into the staging buffer
+  bool write_in_place(const std::string &path, uint64_t size)
+  {
+    tools::download_file f;
+    if (!f.open(path, true, 0))
+      return false;
+    f.reserve(size);
+    for (uint64_t written = 0; written < size; )
+    {
+      const epee::span<char> buffer = f.get_write_buffer();
+      const size_t n = std::min<uint64_t>(buffer.size(), size - written);
+      memset(buffer.data(), 'x', n);
+      if (!f.write(buffer.data(), n))
+        return false;
+      written += n;
+    }
+    return f.close();
+  }
+
+  template<typename F>
+  bool run(const std::string &name, const std::string &path, uint64_t size, F f)
+  {
+    remove(path.c_str());
+    const clock::time_point start = clock::now();
+    const bool ok = f();
+    const double seconds = seconds_since(start);
+    remove(path.c_str());
+    if (!ok)
+    {
+      printf("  %s: failed to write %s\n", name.c_str(), path.c_str());
+      return false;
+    }
+    report_throughput(name, size, seconds);
+    return true;
+  }
+}
+
+// Writing a download to a file, in the pieces the HTTP client hands out.
+// Nothing is synced, this is the cost of getting the data to the page cache.
+int bench_file_write(int argc, char **argv)
+{
+  const uint64_t size = (argc > 0 ? strtoull(argv[0], NULL, 10) : 256) << 20;
+  std::vector<std::string> dirs;
+  for (int i = 1; i < argc; ++i)
+    dirs.push_back(argv[i]);
+  if (dirs.empty())
+  {
+    dirs.push_back("/dev/shm");
+    dirs.push_back(".");
+  }
+
+  bool ok = true;
+  for (const std::string &dir: dirs)
+  {
+    printf("Writing %llu MB to %s\n", (unsigned long long)(size >> 20), dir.c_str());
+    const std::string path = dir + "/monero-update-bench.tmp";
+    ok = run("std::ofstream, 16 kB writes", path, size, [&]() { return write_ofstream(path, size); }) && ok;
+    ok = run("staged pwrite", path, size, [&]() { return write_staged(path, size, false); }) && ok;
+    ok = run("staged pwrite, reserved", path, size, [&]() { return write_staged(path, size, true); }) && ok;
+    ok = run("staged pwrite, reserved, read in place", path, size, [&]() { return write_in_place(path, size); }) && ok;
+  }
+  return ok ? 0 : 1;
+}
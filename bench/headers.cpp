@@ -0,0 +1,89 @@
+/*  monero-update - An downloaded/checker updater for Monero
+ *
+ *  Copyright (c) 2019, The Monero Project
+ *
+ *  All rights reserved.
+ *
+ *  monero-update is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  monero-update is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with monero-update.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include "net/http_client.h"
+#include "fake_net_client.h"
+#include "bench.h"
+
+using namespace bench;
+
+namespace
+{
+  // what GitHub sends with a release asset redirect, give or take
+  const char github_response[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Server: GitHub.com\r\n"
+    "Date: Mon, 01 Jul 2019 12:00:00 GMT\r\n"
+    "Content-Type: application/octet-stream\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: keep-alive\r\n"
+    "Status: 200 OK\r\n"
+    "Cache-Control: max-age=0, private, must-revalidate\r\n"
+    "Vary: X-PJAX, Accept-Encoding, Accept, X-Requested-With\r\n"
+    "ETag: W/\"3f7a4c4b1e2d9a8c7b6f5e4d3c2b1a09\"\r\n"
+    "Last-Modified: Sun, 30 Jun 2019 18:24:11 GMT\r\n"
+    "Accept-Ranges: bytes\r\n"
+    "Content-Disposition: attachment; filename=monero-linux-x64-v0.14.1.2.tar.bz2\r\n"
+    "X-Frame-Options: deny\r\n"
+    "X-Content-Type-Options: nosniff\r\n"
+    "X-XSS-Protection: 1; mode=block\r\n"
+    "Referrer-Policy: origin-when-cross-origin, strict-origin-when-cross-origin\r\n"
+    "Expect-CT: max-age=2592000, report-uri=\"https://api.github.com/_private/browser/errors\"\r\n"
+    "Content-Security-Policy: default-src 'none'; base-uri 'self'; connect-src 'self'; form-action 'self'\r\n"
+    "Strict-Transport-Security: max-age=31536000; includeSubdomains; preload\r\n"
+    "Set-Cookie: _gh_sess=aGVsbG8gd29ybGQ%3D--0123456789abcdef; path=/; secure; HttpOnly\r\n"
+    "Set-Cookie: logged_in=no; domain=.github.com; path=/; expires=Fri, 01 Jul 2039 12:00:00 GMT; secure; HttpOnly\r\n"
+    "Access-Control-Allow-Origin: *\r\n"
+    "Timing-Allow-Origin: https://github.com\r\n"
+    "X-GitHub-Request-Id: 0123:4567:89AB:CDEF:0123456:789ABCD:5D19F1A0\r\n"
+    "X-Cache: MISS\r\n"
+    "Age: 0\r\n"
+    "\r\n";
+}
+
+// Parsing a response with a GitHub sized header
+int bench_headers(int argc, char **argv)
+{
+  const size_t iterations = argc > 0 ? strtoul(argv[0], NULL, 10) : 100000;
+
+  const std::string response = github_response;
+  epee::net_utils::http::http_simple_client_template<fake_net_client> client;
+  if (!client.test(response, std::chrono::seconds(10)))
+  {
+    printf("Failed to parse the response\n");
+    return 1;
+  }
+
+  printf("A response with %zu header fields\n", (size_t)std::count(response.begin(), response.end(), '\n') - 2);
+  bool ok = true;
+  const uint64_t allocations = get_allocations();
+  const double ns = time_per_run(iterations, [&]() { ok = client.test(response, std::chrono::seconds(10)) && ok; });
+  if (!ok)
+  {
+    printf("Failed to parse the response\n");
+    return 1;
+  }
+  report("per response", ns);
+  printf("  %-56s %10.1f\n", "allocations per response", (get_allocations() - allocations) / (double)iterations);
+  return 0;
+}
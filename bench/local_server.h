@@ -0,0 +1,121 @@
+/*  monero-update - An downloaded/checker updater for Monero
+ *
+ *  Copyright (c) 2019, The Monero Project
+ *
+ *  All rights reserved.
+ *
+ *  monero-update is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  monero-update is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with monero-update.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+#include <boost/thread/thread.hpp>
+#include "net/net_ssl.h"
+
+namespace bench
+{
+  // A server on 127.0.0.1, for one client at a time. It answers every request on
+  // a connection with the same response, whose body is `block` repeated up to
+  // `body_size` bytes. With SSL, it uses the generated server certificate.
+  class local_server
+  {
+  public:
+    local_server(bool ssl, std::string header = std::string(), std::string block = std::string(), uint64_t body_size = 0):
+      ssl(ssl), header(std::move(header)), block(std::move(block)), body_size(body_size), stopping(false),
+      acceptor(io_service, boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0))
+    {
+      if (ssl)
+        context.reset(new boost::asio::ssl::context(epee::net_utils::ssl_options_t(epee::net_utils::ssl_support_t::e_ssl_support_enabled).create_context(epee::net_utils::ssl_role_t::server)));
+      thread = boost::thread([this]() { run(); });
+    }
+
+    ~local_server()
+    {
+      // wake up the accept with a connection of our own
+      stopping = true;
+      try
+      {
+        boost::asio::io_service wake_service;
+        boost::asio::ip::tcp::socket wake(wake_service);
+        wake.connect(boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), port()));
+      }
+      catch (...) {}
+      thread.join();
+    }
+
+    uint16_t port() const { return acceptor.local_endpoint().port(); }
+
+  private:
+    void run()
+    {
+      while (!stopping)
+      {
+        try
+        {
+          boost::asio::ip::tcp::socket socket(io_service);
+          acceptor.accept(socket);
+          if (stopping)
+            break;
+          socket.set_option(boost::asio::ip::tcp::no_delay(true));
+          if (ssl)
+          {
+            boost::asio::ssl::stream<boost::asio::ip::tcp::socket&> stream(socket, *context);
+            stream.handshake(boost::asio::ssl::stream_base::server);
+            serve(stream);
+          }
+          else
+            serve(socket);
+        }
+        catch (const std::exception &e) {} // the client went away
+      }
+    }
+
+    template<typename stream_type>
+    void serve(stream_type &stream)
+    {
+      boost::asio::streambuf request;
+      while (true)
+      {
+        boost::system::error_code ec;
+        const size_t size = boost::asio::read_until(stream, request, "\r\n\r\n", ec);
+        if (ec)
+          return;
+        request.consume(size);
+        boost::asio::write(stream, boost::asio::buffer(header));
+        for (uint64_t sent = 0; sent < body_size; )
+        {
+          const size_t n = std::min<uint64_t>(block.size(), body_size - sent);
+          boost::asio::write(stream, boost::asio::buffer(block.data(), n));
+          sent += n;
+        }
+      }
+    }
+
+    const bool ssl;
+    const std::string header;
+    const std::string block;
+    const uint64_t body_size;
+    std::atomic<bool> stopping;
+    boost::asio::io_service io_service;
+    boost::asio::ip::tcp::acceptor acceptor;
+    std::unique_ptr<boost::asio::ssl::context> context;
+    boost::thread thread;
+  };
+}
@@ -0,0 +1,89 @@
+/*  monero-update - An downloaded/checker updater for Monero
+ *
+ *  Copyright (c) 2019, The Monero Project
+ *
+ *  All rights reserved.
+ *
+ *  monero-update is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  monero-update is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with monero-update.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <new>
+#include "misc_log_ex.h"
+#include "bench.h"
+
+static std::atomic<uint64_t> allocations(0);
+
+// counts every allocation, so benchmarks can tell how many they cause
+void *operator new(size_t size)
+{
+  ++allocations;
+  void *ptr = malloc(size ? size : 1);
+  if (!ptr)
+    throw std::bad_alloc();
+  return ptr;
+}
+
+void operator delete(void *ptr) noexcept
+{
+  free(ptr);
+}
+
+uint64_t bench::get_allocations()
+{
+  return allocations;
+}
+
+static const struct
+{
+  const char *name;
+  int (*run)(int argc, char **argv);
+  const char *description;
+} benchmarks[] = {
+  { "ssl", bench_ssl_context, "[iterations] - TLS context creation and connect latency" },
+  { "chunked", bench_chunked, "[MB] [iterations] - chunked body decoding, with small and large chunks" },
+  { "headers", bench_headers, "[iterations] - response header parsing time and allocations" },
+  { "recv", bench_recv, "[MB] - download throughput from a local server, by read size" },
+  { "write", bench_file_write, "[MB] [directory...] - download file write throughput, in /dev/shm and . by default" },
+};
+
+static void usage(const char *argv0)
+{
+  printf("usage: %s [name [args...]]\n", argv0);
+  printf("Runs all benchmarks with their default arguments, or the named one\n");
+  for (const auto &b: benchmarks)
+    printf("  %s %s\n", b.name, b.description);
+}
+
+int main(int argc, char **argv)
+{
+  mlog_configure("", false);
+  mlog_set_log("*:FATAL");
+
+  if (argc < 2)
+  {
+    int ret = 0;
+    for (const auto &b: benchmarks)
+      ret |= b.run(0, NULL);
+    return ret;
+  }
+  for (const auto &b: benchmarks)
+    if (!strcmp(argv[1], b.name))
+      return b.run(argc - 2, argv + 2);
+  usage(argv[0]);
+  return 1;
+}
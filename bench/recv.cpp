@@ -0,0 +1,90 @@
+/*  monero-update - An downloaded/checker updater for Monero
+ *
+ *  Copyright (c) 2019, The Monero Project
+ *
+ *  All rights reserved.
+ *
+ *  monero-update is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  monero-update is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with monero-update.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include "net/http_client.h"
+#include "local_server.h"
+#include "bench.h"
+
+using namespace bench;
+
+namespace
+{
+  // copies the body to a staging buffer, as the downloader does, or has it
+  // read straight there
+  class staging_client: public epee::net_utils::http::http_simple_client
+  {
+  public:
+    staging_client(bool in_place): staging(1024 * 1024, 0), in_place(in_place), reads(0), body_size(0) {}
+    virtual bool handle_target_data(epee::span<const char> piece_of_transfer)
+    {
+      if (piece_of_transfer.data() != staging.data())
+        memcpy(&staging[0], piece_of_transfer.data(), std::min(piece_of_transfer.size(), staging.size()));
+      ++reads;
+      body_size += piece_of_transfer.size();
+      return true;
+    }
+    virtual epee::span<char> get_target_buffer()
+    {
+      return in_place ? epee::span<char>(&staging[0], staging.size()) : nullptr;
+    }
+    std::string staging;
+    const bool in_place;
+    uint64_t reads;
+    uint64_t body_size;
+  };
+
+  bool run(const std::string &name, uint16_t port, uint64_t body_size, size_t min_read, size_t max_read, bool in_place)
+  {
+    staging_client client(in_place);
+    client.set_server("127.0.0.1", std::to_string(port), boost::none, epee::net_utils::ssl_support_t::e_ssl_support_disabled);
+    client.set_recv_buffer_size(min_read, max_read);
+    const clock::time_point start = clock::now();
+    if (!client.invoke_get("/", std::chrono::seconds(60)) || client.body_size != body_size)
+    {
+      printf("  %s: failed to download, %llu bytes\n", name.c_str(), (unsigned long long)client.body_size);
+      return false;
+    }
+    const double seconds = seconds_since(start);
+    report_throughput(name, body_size, seconds);
+    printf("  %-56s %10llu\n", "  body pieces handled", (unsigned long long)client.reads);
+    return true;
+  }
+}
+
+// Downloading from a local server with fixed and growing read sizes, and
+// reading the body in place
+int bench_recv(int argc, char **argv)
+{
+  const uint64_t body_size = (argc > 0 ? strtoull(argv[0], NULL, 10) : 256) << 20;
+
+  const std::string header = "HTTP/1.1 200 OK\r\nContent-Length: " + std::to_string(body_size) + "\r\n\r\n";
+  local_server server(false, header, std::string(1024 * 1024, 'x'), body_size);
+
+  printf("A %llu MB body from 127.0.0.1\n", (unsigned long long)(body_size >> 20));
+  bool ok = true;
+  ok = run("16 kB reads", server.port(), body_size, 16384, 16384, false) && ok;
+  ok = run("16 kB reads, growing to 1 MB", server.port(), body_size, 16384, 1024 * 1024, false) && ok;
+  ok = run("16 kB reads, growing to 1 MB, in place", server.port(), body_size, 16384, 1024 * 1024, true) && ok;
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,79 @@
+/*  monero-update - An downloaded/checker updater for Monero
+ *
+ *  Copyright (c) 2019, The Monero Project
+ *
+ *  All rights reserved.
+ *
+ *  monero-update is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  monero-update is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with monero-update.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+#include "net/net_helper.h"
+#include "net/net_ssl.h"
+#include "local_server.h"
+#include "bench.h"
+
+using namespace epee::net_utils;
+using namespace bench;
+
+// What it costs to get a TLS context, and to connect with one. Every client
+// context used to come with a freshly generated RSA-4096 certificate.
+int bench_ssl_context(int argc, char **argv)
+{
+  const size_t iterations = argc > 0 ? strtoul(argv[0], NULL, 10) : 50;
+  const size_t rsa_iterations = 3;
+
+  printf("TLS contexts\n");
+  const ssl_options_t options(ssl_support_t::e_ssl_support_enabled);
+  report("client context", time_per_run(iterations, [&options]() { options.create_context(ssl_role_t::client); }));
+  options.get_shared_context(ssl_role_t::client); // only the first one is created
+  report("client context, shared", time_per_run(iterations, [&options]() { options.get_shared_context(ssl_role_t::client); }));
+  const double rsa = time_per_run(rsa_iterations, []() {
+    EVP_PKEY *pkey;
+    X509 *cert;
+    if (create_rsa_ssl_certificate(pkey, cert))
+    {
+      X509_free(cert);
+      EVP_PKEY_free(pkey);
+    }
+  });
+  report("RSA-4096 certificate, as every context used to make", rsa);
+  report("server context, first (generates the EC certificate)", time_per_run(1, [&options]() { options.create_context(ssl_role_t::server); }));
+  report("server context, later", time_per_run(iterations, [&options]() { options.create_context(ssl_role_t::server); }));
+
+  printf("TLS connect to 127.0.0.1\n");
+  local_server server(true);
+  const std::string port = std::to_string(server.port());
+  ssl_options_t client_options(ssl_support_t::e_ssl_support_enabled);
+  client_options.verification = ssl_verification_t::none;
+  size_t failed = 0;
+  const double connect = time_per_run(iterations, [&]() {
+    // as http_simple_client::set_server does for every download
+    blocked_mode_client client;
+    client.set_ssl(client_options);
+    if (!client.connect("127.0.0.1", port, std::chrono::seconds(10)))
+      ++failed;
+    client.disconnect();
+  });
+  if (failed)
+  {
+    printf("%zu connections failed\n", failed);
+    return 1;
+  }
+  report("connect", connect);
+  report("connect, with the RSA-4096 certificate it used to make", connect + rsa);
+  return 0;
+}
@@ -217,7 +217,7 @@ ApplicationWindow {
         downloadProgressText.text = "Failed"
       retry.visible = !success
     }
-    onDownloadProgress: function(downloaded, total) {
+    onDownloadProgress: function(downloaded, total, rate, eta) {
       downloadProgressBar.indeterminate = total == 0
       downloadProgressBar.maximumValue = total
       downloadProgressBar.value = downloaded
@@ -225,6 +225,10 @@ ApplicationWindow {
         downloadProgressText.text = bytes_str(downloaded, 0) + " bytes"
       else
         downloadProgressText.text = bytes_str(downloaded, total)  + "/" + bytes_str(total, total)
+      if (rate > 0)
+        downloadProgressText.text += ", " + bytes_str(rate, rate) + "/s"
+      if (eta > 0)
+        downloadProgressText.text += ", " + (eta < 60 ? eta + " s" : Math.ceil(eta / 60) + " min") + " left"
     }
     onValidUpdateReady: function(filename) {
       successFilename.filename = filename
@@ -27,226 +27,1672 @@
 // THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <string>
+#include <algorithm>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 #include <atomic>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <set>
+#include <vector>
 #include <boost/filesystem.hpp>
+#include <boost/thread/condition_variable.hpp>
 #include <boost/thread/thread.hpp>
 #include "file_io_utils.h"
 #include "net/http_client.h"
+#include "sha256sum.h"
+#include "download_file.h"
 #include "download.h"
 
 #undef MONERO_DEFAULT_LOG_CATEGORY
 #define MONERO_DEFAULT_LOG_CATEGORY "net.dl"
 
+#define MAX_IDLE_CONNECTIONS_PER_HOST 8
+#define CONNECTION_IDLE_TIMEOUT 30 // seconds
+
+// segmented downloads do not split files into parts smaller than this
+#define MIN_SEGMENT_SIZE (1024 * 1024)
+
+#define DOWNLOAD_MAX_WORKERS 16
+#define DOWNLOAD_WORKER_IDLE_TIMEOUT 60 // seconds
+
+#define MAX_REDIRECTS 5
+
+// mirrors slower than this to answer are not used
+#define MIRROR_PROBE_TIMEOUT 5 // seconds
+
+// how much is downloaded between saves of a download's manifest
+#define MANIFEST_INTERVAL (8 * 1024 * 1024)
+
+// read sizes, as the HTTP client does by default. Rate limited transfers read
+// no more at a time than their rate allows in RATE_LIMIT_BURST_MS.
+#define MIN_READ_SIZE (16 * 1024)
+#define MAX_READ_SIZE (1024 * 1024)
+#define MIN_RATE_LIMITED_READ_SIZE 4096
+
+// how far ahead of its rate a rate limited transfer may get
+#define RATE_LIMIT_BURST_MS 100
+// longest wait for a rate limit between checks for cancellation
+#define RATE_LIMIT_MAX_WAIT_MS 100
+
+// idle-only transfers slow down to this while there is other traffic
+#define IDLE_ONLY_RATE (32 * 1024) // bytes per second
+// more traffic than ours and this is taken as the network being in use
+#define OTHER_TRAFFIC_THRESHOLD (32 * 1024) // bytes per second
+#define TRAFFIC_SAMPLE_INTERVAL 1 // seconds
+
 namespace tools
 {
+  // Token bucket. Bytes are taken as they are received, and the bucket fills
+  // back at `rate` bytes per second, up to RATE_LIMIT_BURST_MS worth. Taking
+  // more than is left runs it into debt, which the caller waits off before
+  // reading more. Unlimited buckets are never locked.
+  class rate_limiter
+  {
+  public:
+    rate_limiter(uint64_t rate = 0): rate(rate), tokens(0), last(std::chrono::steady_clock::now()) {}
+
+    uint64_t get_rate() const { return rate; }
+
+    void set_rate(uint64_t r)
+    {
+      if (r == rate)
+        return;
+      boost::lock_guard<boost::mutex> lock(mutex);
+      refill();
+      rate = r;
+      tokens = std::min(tokens, get_burst(r));
+    }
+
+    //! takes `size` bytes from the bucket, and returns how long to wait for it to fill back
+    std::chrono::microseconds take(size_t size)
+    {
+      if (rate == 0)
+        return std::chrono::microseconds(0);
+      boost::lock_guard<boost::mutex> lock(mutex);
+      refill();
+      tokens -= size;
+      const uint64_t r = rate;
+      return std::chrono::microseconds(tokens >= 0 || r == 0 ? 0 : -tokens * 1000000 / (int64_t)r);
+    }
+
+    static int64_t get_burst(uint64_t rate) { return rate * RATE_LIMIT_BURST_MS / 1000; }
+
+  private:
+    void refill()
+    {
+      const auto now = std::chrono::steady_clock::now();
+      // anything longer fills the bucket anyway
+      const int64_t us = std::min<int64_t>(std::chrono::duration_cast<std::chrono::microseconds>(now - last).count(), 1000000);
+      last = now;
+      const uint64_t r = rate;
+      if (r > 0)
+        tokens = std::min(tokens + us * (int64_t)r / 1000000, get_burst(r));
+    }
+
+    std::atomic<uint64_t> rate;
+    boost::mutex mutex;
+    int64_t tokens;
+    std::chrono::steady_clock::time_point last;
+  };
+
+  static rate_limiter &get_global_rate_limiter()
+  {
+    static rate_limiter limiter;
+    return limiter;
+  }
+
+  // sums what went in and out of the network interfaces, other than loopback
+  static bool get_interface_traffic(uint64_t &bytes)
+  {
+#ifdef __linux__
+    FILE *f = fopen("/proc/net/dev", "r");
+    if (!f)
+      return false;
+    char line[512];
+    bytes = 0;
+    while (fgets(line, sizeof(line), f))
+    {
+      // "  eth0: <rx bytes> <7 more rx fields> <tx bytes> ...", after two lines of headers
+      char *colon = strchr(line, ':');
+      if (!colon)
+        continue;
+      *colon = 0;
+      if (!strcmp(line + strspn(line, " "), "lo"))
+        continue;
+      unsigned long long rx, tx;
+      if (sscanf(colon + 1, "%llu %*u %*u %*u %*u %*u %*u %*u %llu", &rx, &tx) == 2)
+        bytes += rx + tx;
+    }
+    fclose(f);
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  // Tells idle-only transfers whether anything besides our downloads is using
+  // the network. The interface counters are sampled at most once in a while,
+  // by whichever transfer asks first.
+  class traffic_monitor
+  {
+  public:
+    static traffic_monitor &instance()
+    {
+      static traffic_monitor monitor;
+      return monitor;
+    }
+
+    void add_received(size_t bytes) { received += bytes; }
+
+    bool has_other_traffic()
+    {
+      boost::unique_lock<boost::mutex> lock(mutex, boost::try_to_lock);
+      if (!lock.owns_lock())
+        return busy;
+      const auto now = std::chrono::steady_clock::now();
+      if (sampled && now - last_sample < std::chrono::seconds(TRAFFIC_SAMPLE_INTERVAL))
+        return busy;
+      uint64_t traffic;
+      if (!get_interface_traffic(traffic))
+      {
+        if (!sampled)
+          MWARNING("Network traffic can not be watched here, idle-only downloads will not back off");
+        sampled = true;
+        last_sample = now;
+        return busy = false;
+      }
+      const uint64_t ours = received;
+      if (sampled)
+      {
+        const uint64_t ms = std::max<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(now - last_sample).count(), 1);
+        // our downloads cost a bit more than their payload, in headers and acks
+        const uint64_t own = (ours - last_received) * 9 / 8, all = traffic > last_traffic ? traffic - last_traffic : 0;
+        const uint64_t other = all > own ? (all - own) * 1000 / ms : 0;
+        const bool b = other > OTHER_TRAFFIC_THRESHOLD;
+        if (b && !busy)
+          MINFO("Other network traffic seen (" << other << " bytes/s), slowing idle-only downloads");
+        else if (!b && busy)
+          MINFO("Network idle, idle-only downloads back to full speed");
+        busy = b;
+      }
+      sampled = true;
+      last_sample = now;
+      last_traffic = traffic;
+      last_received = ours;
+      return busy;
+    }
+
+  private:
+    traffic_monitor(): received(0), busy(false), sampled(false), last_traffic(0), last_received(0) {}
+
+    std::atomic<uint64_t> received; // by our downloads, counting every body
+    std::atomic<bool> busy;
+    boost::mutex mutex;
+    bool sampled;
+    std::chrono::steady_clock::time_point last_sample;
+    uint64_t last_traffic;
+    uint64_t last_received;
+  };
+
+  class download_client;
+
   struct download_thread_control
   {
     const std::string path;
     const std::string uri;
     std::function<void(const std::string&, const std::string&, bool)> result_cb;
     std::function<bool(const std::string&, const std::string&, size_t, ssize_t)> progress_cb;
-    bool stop;
+    const download_options options;
+    std::string *buffer;
+    size_t max_size;
+    std::atomic<bool> stop;
     bool stopped;
     bool success;
-    boost::thread thread;
     boost::mutex mutex;
+    boost::condition_variable stopped_cond;
+
+    // for the manifest, only used by the first stream
+    std::string source;      // what the first stream asked for
+    std::string validator;   // ETag or Last-Modified the source sent
+    std::string if_range;    // validator to resume with, if source matches the manifest
+    uint64_t checkpointed;
+
+    rate_limiter limiter; // shared by all segments
+
+    // written by the streams as they go, for get_download_progress
+    std::atomic<uint64_t> downloaded;
+    std::atomic<uint64_t> total;
+    std::atomic<uint64_t> received;
+
+    // what to interrupt when stopping: the clients working on this download,
+    // and the mirror probes it started
+    boost::mutex clients_mutex;
+    std::set<download_client*> clients;
+    std::vector<download_async_handle> probes;
+
+    download_thread_control(const std::string &path, const std::string &uri, std::function<void(const std::string&, const std::string&, bool)> result_cb, std::function<bool(const std::string&, const std::string&, size_t, ssize_t)> progress_cb, const download_options &options):
+        path(path), uri(uri), result_cb(result_cb), progress_cb(progress_cb), options(options), buffer(NULL), max_size(0), stop(false), stopped(false), success(false), checkpointed(0), limiter(options.max_rate), downloaded(0), total(0), received(0) {}
+  };
+
+  static std::set<download_async_handle> stop_active_downloads();
+  class connection_pool;
+  static connection_pool &get_connection_pool();
+
+  // Runs async downloads, and the segments and mirror probes they start. At
+  // most DOWNLOAD_MAX_WORKERS threads are started, as jobs come in, and kept
+  // for a while after their last one; further jobs are queued. Jobs started
+  // by other jobs are nested: they go before the queued downloads, and a job
+  // waiting for them runs them itself when they are still queued, like
+  // threadpool::waiter does, so a full pool does not wait on itself.
+  class download_worker_pool
+  {
+  public:
+    static download_worker_pool &instance()
+    {
+      static download_worker_pool pool;
+      return pool;
+    }
+
+    //! `nested` jobs are ones the submitting job waits for. Other jobs are
+    //! refused once the pool is shutting down, and false returned
+    bool submit(std::function<void()> job, bool nested = false)
+    {
+      boost::lock_guard<boost::mutex> lock(mutex);
+      if (!running && !nested)
+        return false;
+      (nested ? nested_jobs : jobs).push_back(std::move(job));
+      if (idle >= jobs.size() + nested_jobs.size())
+        has_work.notify_one();
+      else if (workers < DOWNLOAD_MAX_WORKERS)
+      {
+        ++workers;
+        boost::thread([this]() { run(); }).detach();
+      }
+      return true;
+    }
+
+    // At exit, downloads still going are cancelled rather than waited out. The
+    // queued ones are cancelled too, and return as soon as a worker picks them up.
+    ~download_worker_pool()
+    {
+      {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        running = false;
+        has_work.notify_all();
+      }
+      stop_active_downloads();
+      boost::unique_lock<boost::mutex> lock(mutex);
+      while (workers > 0)
+        exited.wait(lock);
+    }
+
+    //! for jobs waiting on nested jobs: runs one still queued, or else waits
+    //! on `cond` for a bit. The caller loops until what it waits for is done
+    void help_or_wait(boost::unique_lock<boost::mutex> &lock, boost::condition_variable &cond)
+    {
+      std::function<void()> job;
+      {
+        boost::lock_guard<boost::mutex> pool_lock(mutex);
+        if (!nested_jobs.empty())
+        {
+          job = std::move(nested_jobs.front());
+          nested_jobs.pop_front();
+        }
+      }
+      if (!job)
+      {
+        // a nested job queued after this check is not one the caller waits for
+        cond.wait_for(lock, boost::chrono::milliseconds(100));
+        return;
+      }
+      lock.unlock();
+      run_job(job);
+      lock.lock();
+    }
+
+  private:
+    // the statics workers use are created first, so they are destroyed after
+    // the pool has waited for its workers
+    download_worker_pool(): workers(0), idle(0), running(true)
+    {
+      get_global_rate_limiter();
+      traffic_monitor::instance();
+      get_connection_pool();
+      epee::net_utils::http::url_content url;
+      epee::net_utils::parse_url("http://localhost/", url);
+    }
+
+    static void run_job(const std::function<void()> &job)
+    {
+      try { job(); }
+      catch (const std::exception &e) { MERROR("Exception in download worker: " << e.what()); }
+    }
+
+    void run()
+    {
+      static std::atomic<unsigned int> thread_id(0);
+      MLOG_SET_THREAD_NAME("DL" + std::to_string(thread_id++));
+      boost::unique_lock<boost::mutex> lock(mutex);
+      while (true)
+      {
+        bool timed_out = false;
+        while (jobs.empty() && nested_jobs.empty() && running && !timed_out)
+        {
+          ++idle;
+          timed_out = has_work.wait_for(lock, boost::chrono::seconds(DOWNLOAD_WORKER_IDLE_TIMEOUT)) == boost::cv_status::timeout;
+          --idle;
+        }
+        std::deque<std::function<void()>> &queue = nested_jobs.empty() ? jobs : nested_jobs;
+        if (queue.empty())
+          break;
+        std::function<void()> job = std::move(queue.front());
+        queue.pop_front();
+        lock.unlock();
+        run_job(job);
+        lock.lock();
+      }
+      --workers;
+      exited.notify_all();
+    }
+
+    boost::mutex mutex;
+    boost::condition_variable has_work;
+    boost::condition_variable exited;
+    std::deque<std::function<void()>> jobs;
+    std::deque<std::function<void()>> nested_jobs;
+    size_t workers;
+    size_t idle;
+    bool running;
+  };
+
+  // What is known about a partial download, so a later one can carry on from it
+  struct download_manifest
+  {
+    download_manifest(): offset(0) {}
+
+    std::string url;
+    std::string source;
+    std::string validator;
+    uint64_t offset;      // bytes on disk which the hash state covers
+    std::string hash_state;
+  };
+
+  static std::string get_manifest_path(const std::string &path)
+  {
+    return path + ".manifest";
+  }
+
+  static bool load_manifest(const std::string &path, download_manifest &manifest)
+  {
+    std::ifstream f(get_manifest_path(path));
+    if (!f.good())
+      return false;
+    std::string line, hash_state;
+    bool have_offset = false;
+    while (std::getline(f, line))
+    {
+      const size_t sep = line.find(' ');
+      const std::string key = line.substr(0, sep), value = sep == std::string::npos ? "" : line.substr(sep + 1);
+      if (key == "url")
+        manifest.url = value;
+      else if (key == "source")
+        manifest.source = value;
+      else if (key == "validator")
+        manifest.validator = value;
+      else if (key == "offset")
+        have_offset = epee::string_tools::get_xtype_from_string(manifest.offset, value);
+      else if (key == "sha256-state")
+        hash_state = value;
+    }
+    return have_offset && !manifest.url.empty() && epee::string_tools::parse_hexstr_to_binbuff(hash_state, manifest.hash_state);
+  }
+
+  // written to the side and renamed over the old one, so a crash leaves one or the other
+  static bool save_manifest(const std::string &path, const download_manifest &manifest)
+  {
+    const std::string manifest_path = get_manifest_path(path), tmp_path = manifest_path + ".tmp";
+    const std::string contents =
+        "url " + manifest.url + "\n" +
+        "source " + manifest.source + "\n" +
+        "validator " + manifest.validator + "\n" +
+        "offset " + std::to_string(manifest.offset) + "\n" +
+        "sha256-state " + epee::string_tools::buff_to_hex_nodelimer(manifest.hash_state) + "\n";
+    download_file f;
+    if (!f.open(tmp_path, true, 0) || !f.write(contents.data(), contents.size()) || !f.sync() || !f.close())
+      return false;
+    boost::system::error_code ec;
+    boost::filesystem::rename(tmp_path, manifest_path, ec);
+    return !ec;
+  }
+
+  static void remove_manifest(const std::string &path)
+  {
+    boost::system::error_code ec;
+    boost::filesystem::remove(get_manifest_path(path), ec);
+  }
+
+  // records how far the first stream got, once that much is known to be on disk
+  static bool save_checkpoint(const download_async_handle &control, download_file &f)
+  {
+    if (!control->options.manifest || !control->options.hasher || control->buffer)
+      return false;
+    download_manifest manifest;
+    manifest.offset = f.tell();
+    // the hash state has to describe exactly what is on disk
+    if (control->options.hasher->size() != manifest.offset || !f.sync())
+      return false;
+    manifest.url = control->uri;
+    manifest.source = control->source;
+    manifest.validator = control->validator;
+    manifest.hash_state = control->options.hasher->get_state();
+    if (!save_manifest(control->path, manifest))
+    {
+      MWARNING("Failed to save manifest for " << control->path);
+      return false;
+    }
+    MDEBUG("Saved manifest for " << control->path << " at " << manifest.offset);
+    control->checkpointed = manifest.offset;
+    return true;
+  }
+
+  // downloads queued or in progress, for download_cancel_all
+  static boost::mutex active_downloads_mutex;
+  static std::set<download_async_handle> active_downloads;
+
+  // where a download connects to, derived from its URL
+  struct connection_target
+  {
+    std::string host;
+    std::string port;
+    std::string uri;
+    epee::net_utils::ssl_support_t ssl;
+    std::string pool_key;
+  };
+
+  // The places a file can be fetched from. With more than one, they race to
+  // answer a one byte range request, and are then handed out in the order they
+  // answered, so a stream which fails can carry on from the next one.
+  class mirror_list
+  {
+  public:
+    mirror_list(const std::vector<std::string> &urls): urls(urls), state(std::make_shared<race_state>()) {}
+
+    //! returns once a mirror answered, or all of them failed to
+    void race(const download_async_handle &control);
+    //! the next mirror after `index` which answered, and does ranges if `need_ranges`
+    bool next(size_t &index, bool need_ranges, connection_target &target)
+    {
+      boost::unique_lock<boost::mutex> lock(state->mutex);
+      while (index < state->ranked.size() || state->pending > 0)
+      {
+        if (index == state->ranked.size())
+        {
+          // the slower ones might still come through
+          download_worker_pool::instance().help_or_wait(lock, state->answered);
+          continue;
+        }
+        const mirror &m = state->ranked[index++];
+        if (need_ranges && !m.ranges)
+          continue;
+        target = m.target;
+        return true;
+      }
+      return false;
+    }
+    //! waits for the probes still running
+    void join()
+    {
+      boost::unique_lock<boost::mutex> lock(state->mutex);
+      while (state->pending > 0)
+        download_worker_pool::instance().help_or_wait(lock, state->answered);
+    }
+
+  private:
+    struct mirror
+    {
+      connection_target target; // after any redirects
+      bool ranges;
+    };
+    // probes carry on after the race, the slower ones are ranked as they come in
+    struct race_state
+    {
+      race_state(): pending(0) {}
+      boost::mutex mutex;
+      boost::condition_variable answered;
+      std::vector<mirror> ranked;
+      size_t pending;
+    };
+
+    static void probe(std::shared_ptr<race_state> state, std::string url, download_async_handle parent);
+
+    const std::vector<std::string> urls;
+    std::shared_ptr<race_state> state;
+  };
+
+  // shared by the streams of a segmented download
+  struct segment_set
+  {
+    segment_set(const connection_target &target, const std::shared_ptr<mirror_list> &mirrors, size_t mirror): target(target), mirrors(mirrors), mirror(mirror), file_size(0), first_segment_end(0), hashed_end(0), downloaded(0), failed(false), started(0), running(0) {}
+
+    void start(std::function<void()> f)
+    {
+      {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        ++started;
+        ++running;
+      }
+      download_worker_pool::instance().submit([this, f]() {
+        f();
+        boost::lock_guard<boost::mutex> lock(mutex);
+        if (--running == 0)
+          done.notify_all();
+      }, true);
+    }
+
+    bool has_started() const { return started > 0; }
+
+    void join()
+    {
+      boost::unique_lock<boost::mutex> lock(mutex);
+      while (running > 0)
+        download_worker_pool::instance().help_or_wait(lock, done);
+    }
+
+    connection_target target; // where the first stream ended up, after any redirects
+    const std::shared_ptr<mirror_list> mirrors;
+    const size_t mirror; // mirrors after this one are for failing over to
+    uint64_t file_size;
+    uint64_t first_segment_end;
+    uint64_t hashed_end; // how far the first stream fed the hasher
+    std::atomic<uint64_t> downloaded;
+    std::atomic<bool> failed;
+
+  private:
+    unsigned int started;
+    unsigned int running;
+    boost::mutex mutex;
+    boost::condition_variable done;
+  };
+
+  static void download_segment(download_async_handle control, std::shared_ptr<segment_set> segments, uint64_t start, uint64_t end, connection_target target, size_t mirror);
+
+  // parses "bytes N-M/T"
+  static bool get_content_range(const epee::net_utils::http::http_response_info &headers, uint64_t &start, uint64_t &end, uint64_t &size)
+  {
+    for (const auto &kv: headers.m_header_info.m_etc_fields)
+    {
+      if (epee::string_tools::compare_no_case(kv.first, "Content-Range"))
+        continue;
+      unsigned long long s, e, t;
+      if (sscanf(kv.second.c_str(), "bytes %llu-%llu/%llu", &s, &e, &t) != 3 || s > e || e >= t)
+        return false;
+      start = s;
+      end = e;
+      size = t;
+      return true;
+    }
+    return false;
+  }
+
+  // what to send in If-Range to only get the rest of the same file: a strong ETag, or Last-Modified
+  static std::string get_validator(const epee::net_utils::http::http_response_info &headers)
+  {
+    std::string last_modified;
+    for (const auto &kv: headers.m_header_info.m_etc_fields)
+    {
+      if (!epee::string_tools::compare_no_case(kv.first, "ETag") && kv.second.compare(0, 2, "W/"))
+        return kv.second;
+      if (!epee::string_tools::compare_no_case(kv.first, "Last-Modified"))
+        last_modified = kv.second;
+    }
+    return last_modified;
+  }
+
+  class download_client: public epee::net_utils::http::http_simple_client
+  {
+  public:
+    download_client(): f(NULL), content_length(-1), total(0), offset(0), got_header(false), reusable(false), response_code(0), local_error(false), fixed_segment(false), segment_end(0), segment_done(false), redirected(false), skip_body(false), read_size(MAX_READ_SIZE) {}
+    ~download_client() { end_transfer(); }
+
+    //! attach this (possibly pooled) client to a new transfer
+    void start_transfer(download_async_handle c, download_file *file, uint64_t o, const std::shared_ptr<segment_set> &s = NULL, uint64_t end = 0)
+    {
+      control = c;
+      f = file;
+      content_length = -1;
+      total = 0;
+      offset = o;
+      got_header = false;
+      reusable = false;
+      response_code = 0;
+      local_error = false;
+      segments = s;
+      fixed_segment = end > 0;
+      segment_end = end;
+      segment_done = false;
+      redirected = false;
+      skip_body = false;
+      location.clear();
+      // a pooled client may still be set up for an earlier transfer's rate
+      set_read_size(get_rate());
+      set_deadline(control->options.deadline);
+      // from now on, stopping the download interrupts whatever this is waiting for
+      boost::lock_guard<boost::mutex> lock(control->clients_mutex);
+      control->clients.insert(this);
+      if (control->stop)
+        interrupt();
+    }
+    void end_transfer()
+    {
+      if (control)
+      {
+        boost::lock_guard<boost::mutex> lock(control->clients_mutex);
+        control->clients.erase(this);
+      }
+      control = NULL;
+      f = NULL;
+      segments = NULL;
+    }
+
+    //! true if a response was seen on this connection for the current transfer
+    bool has_header() const { return got_header; }
+    //! status of the last response, or 0 if none was seen
+    int get_response_code() const { return response_code; }
+    //! true if the transfer failed on our side, so another server would not help
+    bool has_local_error() const { return local_error; }
+    //! true if the last response was read in full and the server lets us keep the connection
+    bool is_reusable() { return reusable && is_connected(); }
+    //! true if the transfer was stopped because it reached the end of its segment
+    bool is_segment_done() const { return segment_done; }
+    //! false if the body came to an end short of its Content-Length
+    bool is_complete() const { return content_length < 0 || total >= (size_t)content_length; }
+    //! number of bytes received for the current transfer
+    uint64_t get_total() const { return total; }
+    //! true if the response was a redirect, whose body was skipped
+    bool get_redirect(std::string &target) const { target = location; return redirected; }
+
+    virtual bool on_header(const epee::net_utils::http::http_response_info &headers)
+    {
+      got_header = true;
+      for (const auto &kv: headers.m_header_info.m_etc_fields)
+        MDEBUG("Header: " << kv.first << ": " << kv.second);
+
+      // we can only keep the connection if the body is delimited and the server did not ask to close
+      const epee::net_utils::http::http_header_info &hi = headers.m_header_info;
+      const bool delimited = !hi.m_content_length.empty() || !hi.m_transfer_encoding.empty();
+      const bool http11 = headers.m_http_ver_hi > 1 || (headers.m_http_ver_hi == 1 && headers.m_http_ver_lo >= 1);
+      const bool close = !hi.m_connection.empty() && !epee::string_tools::compare_no_case(epee::string_tools::trim(std::string(hi.m_connection)), "close");
+      reusable = delimited && http11 && !close;
+
+      const int code = response_code = headers.m_response_code;
+      if (code == 301 || code == 302 || code == 303 || code == 307 || code == 308)
+      {
+        for (const auto &kv: headers.m_header_info.m_etc_fields)
+          if (!epee::string_tools::compare_no_case(kv.first, "Location"))
+            location = kv.second;
+        if (!location.empty())
+        {
+          // the body is read and dropped, so the connection can be used for the next hop
+          redirected = skip_body = true;
+          return true;
+        }
+      }
+      if (code != 200 && code != 206)
+      {
+        // an error page is not the file, but it is read so the connection can be kept
+        skip_body = true;
+        return true;
+      }
+      if (!fixed_segment && !control->buffer)
+        control->validator = get_validator(headers);
+
+      if (segments && !on_segment_header(headers))
+      {
+        reusable = false;
+        return false;
+      }
+
+      ssize_t length;
+      if (epee::string_tools::get_xtype_from_string(length, headers.m_header_info.m_content_length) && length >= 0)
+      {
+        MINFO("Content-Length: " << length);
+        content_length = length;
+        if (control->buffer)
+        {
+          if ((size_t)content_length > control->max_size)
+          {
+            MERROR("Content-Length " << content_length << " exceeds the maximum size of " << control->max_size);
+            reusable = false;
+            local_error = true;
+            return false;
+          }
+          control->buffer->reserve(content_length);
+          return true;
+        }
+        if (segments && fixed_segment)
+        {
+          // the whole file was checked for by the first stream
+          return true;
+        }
+        boost::filesystem::path path(control->path);
+        try
+        {
+          boost::filesystem::space_info si = boost::filesystem::space(path);
+          if (si.available < (size_t)content_length)
+          {
+            const uint64_t avail = (si.available + 1023) / 1024, needed = (content_length + 1023) / 1024;
+            MERROR("Not enough space to download " << needed << " kB to " << path << " (" << avail << " kB available)");
+            reusable = false;
+            local_error = true;
+            return false;
+          }
+        }
+        catch (const std::exception &e) { MWARNING("Failed to check for free space"); }
+      }
+      if (offset > 0 && !segments)
+      {
+        // we requested a range, a full response means the server can't do ranges, or
+        // the file changed since we got the first part
+        uint64_t start, end, size;
+        if (code == 206 && (!get_content_range(headers, start, end, size) || start != offset))
+        {
+          MERROR("Unexpected range in response for " << control->uri << " from " << offset);
+          reusable = false;
+          return false;
+        }
+        if (code == 200)
+        {
+          MWARNING("We did not get the requested range, downloading from start");
+          if (control->options.manifest)
+            remove_manifest(control->path);
+          control->checkpointed = 0;
+          if (!f->truncate() || (control->options.hasher && !control->options.hasher->reset()))
+          {
+            reusable = false;
+            local_error = true;
+            return false;
+          }
+        }
+      }
+      if (content_length >= 0)
+      {
+        const uint64_t size = control->buffer ? content_length : f->tell() + content_length;
+        control->total.store(size, std::memory_order_relaxed);
+        if (!segments)
+          control->downloaded.store(control->buffer ? 0 : f->tell(), std::memory_order_relaxed);
+        // the whole extent in one go, so the file does not fragment as it grows
+        if (!control->buffer)
+          f->reserve(size);
+      }
+      return true;
+    }
+    virtual bool handle_target_data(epee::span<const char> piece_of_transfer)
+    {
+      if (!pace(piece_of_transfer.size()))
+      {
+        reusable = false;
+        return false;
+      }
+      if (skip_body)
+        return true;
+      // a partially read body leaves the connection in an unknown state
+      const bool ok = write_target_data(piece_of_transfer);
+      if (!ok)
+        reusable = false;
+      return ok;
+    }
+    virtual epee::span<char> get_target_buffer()
+    {
+      // the body goes straight into the file's staging buffer
+      if (skip_body || control->buffer || !f)
+        return nullptr;
+      return f->get_write_buffer();
+    }
+  private:
+    // the lowest of the limits on this transfer, 0 if none
+    uint64_t get_rate()
+    {
+      uint64_t rate = control->options.max_rate;
+      if (control->options.idle_only && traffic_monitor::instance().has_other_traffic())
+        rate = rate ? std::min<uint64_t>(rate, IDLE_ONLY_RATE) : IDLE_ONLY_RATE;
+      control->limiter.set_rate(rate);
+      const uint64_t global_rate = get_global_rate_limiter().get_rate();
+      return rate == 0 || (global_rate > 0 && global_rate < rate) ? global_rate : rate;
+    }
+
+    // reading a lot at once would just mean waiting longer for it after
+    void set_read_size(uint64_t rate)
+    {
+      const size_t size = rate ? std::max<size_t>(std::min<uint64_t>(rate_limiter::get_burst(rate), MAX_READ_SIZE), MIN_RATE_LIMITED_READ_SIZE) : MAX_READ_SIZE;
+      if (size == read_size)
+        return;
+      set_recv_buffer_size(std::min<size_t>(MIN_READ_SIZE, size), size);
+      read_size = size;
+    }
+
+    // holds the receive loop back to the rate limits
+    bool pace(size_t size)
+    {
+      traffic_monitor::instance().add_received(size);
+      set_read_size(get_rate());
+      std::chrono::microseconds wait = std::max(get_global_rate_limiter().take(size), control->limiter.take(size));
+      while (wait.count() > 0)
+      {
+        const std::chrono::microseconds step = std::min<std::chrono::microseconds>(wait, std::chrono::milliseconds(RATE_LIMIT_MAX_WAIT_MS));
+        boost::this_thread::sleep_for(boost::chrono::microseconds(step.count()));
+        wait -= step;
+        if (control->stop)
+          return false;
+        if (std::chrono::steady_clock::now() >= control->options.deadline)
+        {
+          MERROR("Download of " << control->uri << " ran out of time");
+          local_error = true;
+          return false;
+        }
+      }
+      return true;
+    }
+
+    bool on_segment_header(const epee::net_utils::http::http_response_info &headers)
+    {
+      uint64_t start, end, size;
+      const bool partial = headers.m_response_code == 206 && get_content_range(headers, start, end, size);
+      if (fixed_segment)
+      {
+        // a later segment, we need exactly what we asked for
+        if (!partial || start != offset || end + 1 != segment_end || size != segments->file_size)
+        {
+          MERROR("Unexpected response for segment " << offset << "-" << segment_end << " of " << control->uri);
+          return false;
+        }
+        return true;
+      }
+
+      // the first stream asked for the whole file, split it if the server does ranges
+      if (!partial || start != 0 || end + 1 != size)
+      {
+        MINFO("Server did not send a range, downloading " << control->uri << " in a single stream");
+        segments = NULL;
+        return true;
+      }
+      const unsigned int count = control->options.segments;
+      if (size < count * MIN_SEGMENT_SIZE)
+      {
+        MDEBUG("Too small to split, downloading " << control->uri << " in a single stream");
+        segments = NULL;
+        return true;
+      }
+
+      // preallocate so every segment can write at its own offset
+      if (!f->resize(size))
+      {
+        MERROR("Failed to allocate " << size << " bytes for " << control->path);
+        local_error = true;
+        return false;
+      }
+      const uint64_t segment_size = size / count;
+      segments->file_size = size;
+      control->total.store(size, std::memory_order_relaxed);
+      segments->first_segment_end = segment_end = segment_size;
+      MINFO("Downloading " << control->uri << " in " << count << " segments of " << segment_size << " bytes");
+      for (unsigned int n = 1; n < count; ++n)
+      {
+        const uint64_t start = n * segment_size, end = n + 1 == count ? size : start + segment_size;
+        const download_async_handle c = control;
+        const std::shared_ptr<segment_set> s = segments;
+        segments->start([c, s, start, end]() { download_segment(c, s, start, end, s->target, s->mirror); });
+      }
+      return true;
+    }
+
+    bool write_target_data(epee::span<const char> piece_of_transfer)
+    {
+      // nothing here is shared between streams but atomics, so no lock is taken: the
+      // buffer, hasher and manifest are only ever used by the first stream
+      try
+      {
+        if (control->stop)
+          return false;
+        if (control->buffer)
+        {
+          if (piece_of_transfer.size() > control->max_size - control->buffer->size())
+          {
+            MERROR("Download from " << control->uri << " exceeds the maximum size of " << control->max_size);
+            local_error = true;
+            return false;
+          }
+          control->buffer->append(piece_of_transfer.data(), piece_of_transfer.size());
+          total += piece_of_transfer.size();
+          control->received.fetch_add(piece_of_transfer.size(), std::memory_order_relaxed);
+          control->downloaded.store(control->buffer->size(), std::memory_order_relaxed);
+          local_error = control->progress_cb && !control->progress_cb(control->path, control->uri, total, content_length);
+          return !local_error;
+        }
+        size_t size = piece_of_transfer.size();
+        if (segments)
+        {
+          if (segments->failed)
+            return false;
+          if (offset + total + size > segment_end)
+          {
+            // the first stream was asked for the whole file, and stops at the end of its segment
+            size = segment_end - offset - total;
+            segment_done = true;
+          }
+        }
+        if (!f->write(piece_of_transfer.data(), size))
+        {
+          local_error = true;
+          return false;
+        }
+        // only the first stream is hashed as it comes in
+        const bool hashed = !segments || !fixed_segment;
+        if (hashed && control->options.hasher && !control->options.hasher->update(piece_of_transfer.data(), size))
+        {
+          local_error = true;
+          return false;
+        }
+        total += size;
+        control->received.fetch_add(size, std::memory_order_relaxed);
+        if (hashed && control->options.manifest && f->tell() >= control->checkpointed + MANIFEST_INTERVAL)
+          save_checkpoint(control, *f);
+        if (segments)
+        {
+          const uint64_t downloaded = segments->downloaded += size;
+          control->downloaded.store(downloaded, std::memory_order_relaxed);
+          local_error = control->progress_cb && !control->progress_cb(control->path, control->uri, downloaded, segments->file_size);
+        }
+        else
+        {
+          control->downloaded.store(f->tell(), std::memory_order_relaxed);
+          local_error = control->progress_cb && !control->progress_cb(control->path, control->uri, total, content_length);
+        }
+        local_error = local_error || !f->good();
+        return !local_error && !segment_done;
+      }
+      catch (const std::exception &e)
+      {
+        MERROR("Error writing data: " << e.what());
+        local_error = true;
+        return false;
+      }
+    }
+
+    download_async_handle control;
+    download_file *f;
+    ssize_t content_length;
+    size_t total;
+    uint64_t offset;
+    bool got_header;
+    bool reusable;
+    int response_code;
+    bool local_error;
+    std::shared_ptr<segment_set> segments;
+    bool fixed_segment; // a later segment, rather than the first stream
+    uint64_t segment_end;
+    bool segment_done;
+    bool redirected;
+    bool skip_body;
+    std::string location;
+    size_t read_size; // most the HTTP client is set to read at once
+  };
 
-    download_thread_control(const std::string &path, const std::string &uri, std::function<void(const std::string&, const std::string&, bool)> result_cb, std::function<bool(const std::string&, const std::string&, size_t, ssize_t)> progress_cb):
-        path(path), uri(uri), result_cb(result_cb), progress_cb(progress_cb), stop(false), stopped(false), success(false) {}
-    ~download_thread_control() { if (thread.joinable()) thread.detach(); }
+  // Idle keep-alive connections, keyed by scheme/host/port, so that several
+  // requests to the same server share a TCP connection and TLS session
+  class connection_pool
+  {
+  public:
+    connection_pool(): hits(0), misses(0) {}
+
+    std::unique_ptr<download_client> borrow(const std::string &key, bool &reused)
+    {
+      boost::lock_guard<boost::mutex> lock(mutex);
+      evict_idle();
+      auto i = idle.find(key);
+      while (i != idle.end() && !i->second.empty())
+      {
+        std::unique_ptr<download_client> client = std::move(i->second.back().client);
+        i->second.pop_back();
+        if (client->is_connected())
+        {
+          ++hits;
+          reused = true;
+          return client;
+        }
+      }
+      ++misses;
+      reused = false;
+      return std::unique_ptr<download_client>(new download_client());
+    }
+
+    void give_back(const std::string &key, std::unique_ptr<download_client> client)
+    {
+      if (!client->is_reusable())
+        return;
+      boost::lock_guard<boost::mutex> lock(mutex);
+      std::vector<entry> &entries = idle[key];
+      if (entries.size() >= MAX_IDLE_CONNECTIONS_PER_HOST)
+        entries.erase(entries.begin());
+      entries.push_back({std::move(client), std::chrono::steady_clock::now()});
+    }
+
+    download_pool_stats get_stats()
+    {
+      boost::lock_guard<boost::mutex> lock(mutex);
+      download_pool_stats stats;
+      stats.hits = hits;
+      stats.misses = misses;
+      stats.idle = 0;
+      stats.tls_handshakes = 0;
+      stats.tls_resumed = 0;
+      for (const auto &e: idle)
+        stats.idle += e.second.size();
+      return stats;
+    }
+
+  private:
+    struct entry
+    {
+      std::unique_ptr<download_client> client;
+      std::chrono::steady_clock::time_point last_used;
+    };
+
+    void evict_idle()
+    {
+      const auto now = std::chrono::steady_clock::now();
+      for (auto i = idle.begin(); i != idle.end(); )
+      {
+        std::vector<entry> &entries = i->second;
+        entries.erase(std::remove_if(entries.begin(), entries.end(), [now](const entry &e) {
+          return now - e.last_used > std::chrono::seconds(CONNECTION_IDLE_TIMEOUT);
+        }), entries.end());
+        if (entries.empty())
+          i = idle.erase(i);
+        else
+          ++i;
+      }
+    }
+
+    boost::mutex mutex;
+    std::map<std::string, std::vector<entry>> idle;
+    uint64_t hits;
+    uint64_t misses;
   };
 
-  static void download_thread(download_async_handle control)
+  static connection_pool &get_connection_pool()
+  {
+    static connection_pool pool;
+    return pool;
+  }
+
+  static std::atomic<bool> session_resumption(false);
+
+  static bool get_connection_target(const std::string &url, connection_target &target)
+  {
+    epee::net_utils::http::url_content u_c;
+    if (!epee::net_utils::parse_url(url, u_c))
+    {
+      MERROR("Failed to parse URL " << url);
+      return false;
+    }
+    if (u_c.host.empty())
+    {
+      MERROR("Failed to determine address from URL " << url);
+      return false;
+    }
+    target.ssl = u_c.schema == "https" ? epee::net_utils::ssl_support_t::e_ssl_support_enabled : epee::net_utils::ssl_support_t::e_ssl_support_disabled;
+    const uint16_t port = u_c.port ? u_c.port : target.ssl == epee::net_utils::ssl_support_t::e_ssl_support_enabled ? 443 : 80;
+    target.host = u_c.host;
+    target.port = std::to_string(port);
+    target.uri = u_c.uri;
+    target.pool_key = u_c.schema + "://" + u_c.host + ":" + target.port;
+    return true;
+  }
+
+  // resolves a Location header against the URL it came from
+  static bool get_redirect_target(const connection_target &from, std::string location, connection_target &target)
+  {
+    const size_t fragment = location.find('#');
+    if (fragment != std::string::npos)
+      location.erase(fragment);
+    if (location.compare(0, 2, "//") == 0)
+      location = (from.ssl == epee::net_utils::ssl_support_t::e_ssl_support_enabled ? "https:" : "http:") + location;
+
+    if (location.find("://") != std::string::npos)
+    {
+      const std::string scheme = location.substr(0, location.find("://"));
+      if (epee::string_tools::compare_no_case(scheme, "http") && epee::string_tools::compare_no_case(scheme, "https"))
+      {
+        MERROR("Refusing to follow redirect to " << location);
+        return false;
+      }
+      if (!get_connection_target(location, target))
+        return false;
+    }
+    else
+    {
+      target = from;
+      if (location.empty() || location[0] != '/')
+      {
+        // relative to the directory of the current path
+        const std::string path = from.uri.substr(0, from.uri.find('?'));
+        location = path.substr(0, path.rfind('/') + 1) + location;
+      }
+      target.uri = location;
+    }
+
+    if (from.ssl == epee::net_utils::ssl_support_t::e_ssl_support_enabled && target.ssl != epee::net_utils::ssl_support_t::e_ssl_support_enabled)
+    {
+      MERROR("Refusing to follow redirect from HTTPS to HTTP: " << location);
+      return false;
+    }
+    return true;
+  }
+
+  // GETs on a pooled connection if there is one. If it turns out the server closed that
+  // connection under us, tries again once on a fresh one. `prepare` sets up the client for
+  // each attempt.
+  static bool pooled_get_once(const connection_target &target, std::unique_ptr<download_client> &client, const std::function<void(download_client&)> &prepare, const epee::net_utils::http::fields_list &fields, const epee::net_utils::http::http_response_info **info, std::chrono::milliseconds timeout)
+  {
+    bool reused;
+    client = get_connection_pool().borrow(target.pool_key, reused);
+    prepare(*client);
+    if (reused)
+      MDEBUG("Reusing connection to " << target.host << ":" << target.port);
+    else
+    {
+      MDEBUG("Connecting to " << target.host << ":" << target.port);
+      epee::net_utils::ssl_options_t ssl_options(target.ssl);
+      ssl_options.session_resumption = session_resumption;
+      client->set_server(target.host, target.port, boost::none, std::move(ssl_options));
+      if (!client->connect(timeout))
+        return false;
+    }
+    MDEBUG("GETting " << target.uri);
+    bool r = client->invoke_get(target.uri, timeout, "", info, fields);
+    if (!r && reused && !client->has_header())
+    {
+      MDEBUG("Pooled connection to " << target.host << ":" << target.port << " failed, reconnecting");
+      client->disconnect();
+      prepare(*client);
+      r = client->connect(timeout) && client->invoke_get(target.uri, timeout, "", info, fields);
+    }
+    return r;
+  }
+
+  // pooled_get_once, following redirects. `target` is updated to where the response came from.
+  static bool pooled_get(connection_target &target, std::unique_ptr<download_client> &client, const std::function<void(download_client&)> &prepare, const epee::net_utils::http::fields_list &fields, const epee::net_utils::http::http_response_info **info, std::chrono::milliseconds timeout = std::chrono::seconds(30))
+  {
+    for (unsigned int hops = 0; ; ++hops)
+    {
+      if (!pooled_get_once(target, client, prepare, fields, info, timeout))
+        return false;
+      std::string location;
+      if (!client->get_redirect(location))
+        return true;
+      if (hops == MAX_REDIRECTS)
+      {
+        MERROR("Too many redirects, giving up at " << location);
+        return false;
+      }
+      connection_target next;
+      if (!get_redirect_target(target, location, next))
+        return false;
+      MINFO("Redirected from " << target.pool_key << target.uri << " to " << next.pool_key << next.uri);
+
+      // if the next hop is on the same host, it will get this connection back from the pool
+      client->end_transfer();
+      if (client->is_reusable())
+        get_connection_pool().give_back(target.pool_key, std::move(client));
+      else
+        client->disconnect();
+      target = next;
+    }
+  }
+
+  void mirror_list::probe(std::shared_ptr<race_state> state, std::string url, download_async_handle parent)
+  {
+    bool answered = false, ranges = false;
+    connection_target target;
+    const auto start = std::chrono::steady_clock::now();
+    try
+    {
+      if (get_connection_target(url, target))
+      {
+        std::string body;
+        download_options options;
+        options.deadline = parent->options.deadline;
+        download_async_handle control = std::make_shared<download_thread_control>("", url, nullptr, nullptr, options);
+        control->buffer = &body;
+        control->max_size = 1;
+        // stopping the download stops its probes too
+        {
+          boost::lock_guard<boost::mutex> lock(parent->clients_mutex);
+          parent->probes.push_back(control);
+          control->stop = parent->stop.load();
+        }
+        epee::net_utils::http::fields_list fields;
+        fields.push_back(std::make_pair("Range", "bytes=0-0"));
+        std::unique_ptr<download_client> client;
+        const epee::net_utils::http::http_response_info *info = NULL;
+        const bool r = pooled_get(target, client, [&](download_client &c) { c.start_transfer(control, NULL, 0); }, fields, &info, std::chrono::seconds(MIRROR_PROBE_TIMEOUT));
+        answered = client->get_response_code() == 200 || client->get_response_code() == 206;
+        ranges = r && client->get_response_code() == 206;
+        client->end_transfer();
+        // the download will likely want this connection next
+        if (ranges)
+          get_connection_pool().give_back(target.pool_key, std::move(client));
+        else
+          client->disconnect();
+        boost::lock_guard<boost::mutex> lock(parent->clients_mutex);
+        parent->probes.erase(std::remove(parent->probes.begin(), parent->probes.end(), control), parent->probes.end());
+      }
+    }
+    catch (const std::exception &e)
+    {
+      MERROR("Exception probing " << url << ": " << e.what());
+    }
+
+    const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    if (answered)
+      MINFO("Mirror " << url << " answered in " << ms << " ms" << (ranges ? "" : ", without ranges"));
+    else if (parent->stop)
+      MDEBUG("Probing mirror " << url << " cancelled");
+    else
+      MWARNING("Mirror " << url << " did not answer");
+    boost::lock_guard<boost::mutex> lock(state->mutex);
+    if (answered)
+      state->ranked.push_back({target, ranges});
+    --state->pending;
+    state->answered.notify_all();
+  }
+
+  void mirror_list::race(const download_async_handle &control)
+  {
+    if (urls.size() == 1)
+    {
+      // nothing to race, and nothing to fail over to
+      connection_target target;
+      if (get_connection_target(urls[0], target))
+        state->ranked.push_back({target, true});
+      return;
+    }
+
+    state->pending = urls.size();
+    for (const std::string &url: urls)
+    {
+      const std::shared_ptr<race_state> s = state;
+      download_worker_pool::instance().submit([s, url, control]() { probe(s, url, control); }, true);
+    }
+    boost::unique_lock<boost::mutex> lock(state->mutex);
+    while (state->ranked.empty() && state->pending > 0)
+    {
+      download_worker_pool::instance().help_or_wait(lock, state->answered);
+      if (control->stop)
+        return;
+    }
+  }
+
+  static void download_segment(download_async_handle control, std::shared_ptr<segment_set> segments, uint64_t start, uint64_t end, connection_target target, size_t mirror)
   {
-    static std::atomic<unsigned int> thread_id(0);
+    try
+    {
+      // a handle of our own, so writes from the other segments do not move our position
+      download_file f;
+      if (!f.open(control->path, false, start))
+      {
+        MERROR("Failed to open " << control->path << " at " << start);
+        segments->failed = true;
+        return;
+      }
+
+      while (true)
+      {
+        epee::net_utils::http::fields_list fields;
+        fields.push_back(std::make_pair("Range", "bytes=" + std::to_string(start) + "-" + std::to_string(end - 1)));
+        std::unique_ptr<download_client> client;
+        const epee::net_utils::http::http_response_info *info = NULL;
+        const bool r = pooled_get(target, client, [&](download_client &c) { c.start_transfer(control, &f, start, segments, end); }, fields, &info);
+        const bool complete = r && info && info->m_response_code == 206 && client->get_total() == end - start;
+        const bool flushed = f.flush();
+        client->end_transfer();
+        if (complete && flushed && f.close())
+        {
+          MDEBUG("Segment " << start << "-" << end << " of " << control->uri << " complete");
+          get_connection_pool().give_back(target.pool_key, std::move(client));
+          return;
+        }
+        client->disconnect();
+        if (control->stop || segments->failed || client->has_local_error() || !f.good())
+          break;
+        // what we got is good, ask the next mirror for the rest
+        start += client->get_total();
+        if (!segments->mirrors->next(mirror, true, target))
+          break;
+        MWARNING("Segment of " << control->uri << " failed, carrying on from " << start << " on " << target.pool_key);
+      }
+      if (!control->stop)
+        MERROR("Failed to download segment " << start << "-" << end << " of " << control->uri);
+    }
+    catch (const std::exception &e)
+    {
+      MERROR("Exception downloading segment: " << e.what());
+    }
+    segments->failed = true;
+  }
 
-    MLOG_SET_THREAD_NAME("DL" + std::to_string(thread_id++));
+  // keeps the manifest in step with the file, then tells the caller how it went
+  static void report_result(const download_async_handle &control, download_file &f)
+  {
+    if (control->options.manifest && !control->buffer)
+    {
+      if (control->success)
+        remove_manifest(control->path);
+      else
+        save_checkpoint(control, f);
+    }
+    control->result_cb(control->path, control->uri, control->success);
+  }
 
+  static void download_thread(download_async_handle control)
+  {
+    {
+      boost::lock_guard<boost::mutex> lock(active_downloads_mutex);
+      active_downloads.insert(control);
+    }
     struct stopped_setter
     {
       stopped_setter(const download_async_handle &control): control(control) {}
-      ~stopped_setter() { control->stopped = true; }
+      ~stopped_setter()
+      {
+        {
+          boost::lock_guard<boost::mutex> lock(active_downloads_mutex);
+          active_downloads.erase(control);
+        }
+        boost::lock_guard<boost::mutex> lock(control->mutex);
+        control->stopped = true;
+        control->stopped_cond.notify_all();
+      }
       download_async_handle control;
     } stopped_setter(control);
 
+    // segments are joined before the result is reported, or on the way out
+    struct segment_joiner
+    {
+      ~segment_joiner() { if (segments) { segments->failed = true; segments->join(); } }
+      std::shared_ptr<segment_set> segments;
+    } segment_joiner;
+
     try
     {
       boost::unique_lock<boost::mutex> lock(control->mutex);
-      std::ios_base::openmode mode = std::ios_base::out | std::ios_base::binary;
-      uint64_t existing_size = 0;
-      if (epee::file_io_utils::get_file_size(control->path, existing_size) && existing_size > 0)
-      {
-        MINFO("Resuming downloading " << control->uri << " to " << control->path << " from " << existing_size);
-        mode |= std::ios_base::app;
-      }
-      else
+      if (control->stop)
       {
-        MINFO("Downloading " << control->uri << " to " << control->path);
-        mode |= std::ios_base::trunc;
-      }
-      std::ofstream f;
-      f.open(control->path, mode);
-      if (!f.good()) {
-        MERROR("Failed to open file " << control->path);
+        // cancelled while waiting for a worker
+        MDEBUG("Download cancelled");
         control->result_cb(control->path, control->uri, control->success);
         return;
       }
-      class download_client: public epee::net_utils::http::http_simple_client
+      download_file f;
+      uint64_t existing_size = 0;
+      if (control->buffer)
+      {
+        MINFO("Downloading " << control->uri << " to memory");
+        control->buffer->clear();
+      }
+      else
       {
-      public:
-        download_client(download_async_handle control, std::ofstream &f, uint64_t offset = 0):
-          control(control), f(f), content_length(-1), total(0), offset(offset) {}
-        virtual ~download_client() { f.close(); }
-        virtual bool on_header(const epee::net_utils::http::http_response_info &headers)
+        bool from_manifest = false;
+        if (control->options.manifest && control->options.hasher)
         {
-          for (const auto &kv: headers.m_header_info.m_etc_fields)
-            MDEBUG("Header: " << kv.first << ": " << kv.second);
-          ssize_t length;
-          if (epee::string_tools::get_xtype_from_string(length, headers.m_header_info.m_content_length) && length >= 0)
+          // only what the manifest vouches for is kept, and its hash state saves reading it again
+          download_manifest manifest;
+          from_manifest = load_manifest(control->path, manifest) && manifest.url == control->uri &&
+              epee::file_io_utils::get_file_size(control->path, existing_size) && existing_size >= manifest.offset &&
+              control->options.hasher->set_state(manifest.hash_state) && control->options.hasher->size() == manifest.offset;
+          existing_size = from_manifest ? manifest.offset : 0;
+          if (from_manifest && existing_size > 0)
           {
-            MINFO("Content-Length: " << length);
-            content_length = length;
-            boost::filesystem::path path(control->path);
-            try
-            {
-              boost::filesystem::space_info si = boost::filesystem::space(path);
-              if (si.available < (size_t)content_length)
-              {
-                const uint64_t avail = (si.available + 1023) / 1024, needed = (content_length + 1023) / 1024;
-                MERROR("Not enough space to download " << needed << " kB to " << path << " (" << avail << " kB available)");
-                return false;
-              }
-            }
-            catch (const std::exception &e) { MWARNING("Failed to check for free space"); }
+            MINFO("Resuming downloading " << control->uri << " to " << control->path << " from " << existing_size << " per its manifest");
+            control->source = manifest.source;
+            control->validator = control->if_range = manifest.validator;
+            control->checkpointed = existing_size;
           }
-          if (offset > 0)
-          {
-            // we requested a range, so check if we're getting it, otherwise truncate
-            bool got_range = false;
-            const std::string prefix = "bytes=" + std::to_string(offset) + "-";
-            for (const auto &kv: headers.m_header_info.m_etc_fields)
-            {
-              if (kv.first == "Content-Range" && strncmp(kv.second.c_str(), prefix.c_str(), prefix.size()))
-              {
-                got_range = true;
-                break;
-              }
-            }
-            if (!got_range)
-            {
-              MWARNING("We did not get the requested range, downloading from start");
-              f.close();
-              f.open(control->path, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
-            }
-          }
-          return true;
+          else
+            MINFO("Downloading " << control->uri << " to " << control->path);
         }
-        virtual bool handle_target_data(std::string &piece_of_transfer)
+        else if (epee::file_io_utils::get_file_size(control->path, existing_size) && existing_size > 0)
         {
-          try
-          {
-            boost::lock_guard<boost::mutex> lock(control->mutex);
-            if (control->stop)
-              return false;
-            f << piece_of_transfer;
-            total += piece_of_transfer.size();
-            if (control->progress_cb && !control->progress_cb(control->path, control->uri, total, content_length))
-              return false;
-            return f.good();
-          }
-          catch (const std::exception &e)
+          MINFO("Resuming downloading " << control->uri << " to " << control->path << " from " << existing_size);
+        }
+        else
+        {
+          MINFO("Downloading " << control->uri << " to " << control->path);
+          existing_size = 0;
+        }
+        if (control->options.hasher && !from_manifest)
+        {
+          // bring the digest up to date with what we already have, once
+          if (!control->options.hasher->reset() || (existing_size > 0 && !control->options.hasher->update_from_file(control->path, existing_size)))
           {
-            MERROR("Error writing data: " << e.what());
-            return false;
+            MERROR("Failed to hash existing data in " << control->path);
+            control->result_cb(control->path, control->uri, control->success);
+            return;
           }
         }
-      private:
-        download_async_handle control;
-        std::ofstream &f;
-        ssize_t content_length;
-        size_t total;
-        uint64_t offset;
-      } client(control, f, existing_size);
-      epee::net_utils::http::url_content u_c;
-      if (!epee::net_utils::parse_url(control->uri, u_c))
-      {
-        MERROR("Failed to parse URL " << control->uri);
-        control->result_cb(control->path, control->uri, control->success);
-        return;
-      }
-      if (u_c.host.empty())
-      {
-        MERROR("Failed to determine address from URL " << control->uri);
-        control->result_cb(control->path, control->uri, control->success);
-        return;
+        // anything past the manifest's offset may not have made it to disk whole
+        if (!f.open(control->path, existing_size == 0, existing_size) || (from_manifest && !f.trim())) {
+          MERROR("Failed to open file " << control->path);
+          control->result_cb(control->path, control->uri, control->success);
+          return;
+        }
       }
-
       lock.unlock();
 
-      epee::net_utils::ssl_support_t ssl = u_c.schema == "https" ? epee::net_utils::ssl_support_t::e_ssl_support_enabled : epee::net_utils::ssl_support_t::e_ssl_support_disabled;
-      uint16_t port = u_c.port ? u_c.port : ssl == epee::net_utils::ssl_support_t::e_ssl_support_enabled ? 443 : 80;
-      MDEBUG("Connecting to " << u_c.host << ":" << port);
-      client.set_server(u_c.host, std::to_string(port), boost::none, ssl);
-      if (!client.connect(std::chrono::seconds(30)))
+      // only files can carry on from another mirror, buffers are small anyway
+      std::vector<std::string> urls(1, control->uri);
+      if (!control->buffer)
+        urls.insert(urls.end(), control->options.mirrors.begin(), control->options.mirrors.end());
+      const std::shared_ptr<mirror_list> mirrors = std::make_shared<mirror_list>(urls);
+      // probes use the connection pool, so they must be done before we say we are
+      struct probe_joiner
       {
-        boost::lock_guard<boost::mutex> lock(control->mutex);
-        MERROR("Failed to connect to " << control->uri);
-        control->result_cb(control->path, control->uri, control->success);
-        return;
-      }
-      MDEBUG("GETting " << u_c.uri);
+        ~probe_joiner() { mirrors->join(); }
+        std::shared_ptr<mirror_list> mirrors;
+      } probe_joiner{mirrors};
+      mirrors->race(control);
+
       const epee::net_utils::http::http_response_info *info = NULL;
-      epee::net_utils::http::fields_list fields;
-      if (existing_size > 0)
+      std::shared_ptr<segment_set> segments;
+      std::unique_ptr<download_client> client;
+      connection_target target;
+      size_t mirror = 0;
+      bool r = false;
+      while (true)
       {
-        const std::string range = "bytes=" + std::to_string(existing_size) + "-";
-        MDEBUG("Asking for range: " << range);
-        fields.push_back(std::make_pair("Range", range));
+        if (!mirrors->next(mirror, existing_size > 0, target))
+        {
+          boost::lock_guard<boost::mutex> lock(control->mutex);
+          if (control->stop)
+            MDEBUG("Download cancelled");
+          else
+            MERROR("No server left to download " << control->uri << " from");
+          if (client)
+            client->disconnect();
+          report_result(control, f);
+          return;
+        }
+        epee::net_utils::http::fields_list fields;
+        segments = NULL;
+        const std::string source = target.pool_key + target.uri;
+        if (existing_size > 0)
+        {
+          const std::string range = "bytes=" + std::to_string(existing_size) + "-";
+          MDEBUG("Asking for range: " << range);
+          fields.push_back(std::make_pair("Range", range));
+          // the validator from the manifest is only good for where it came from
+          if (!control->if_range.empty() && source == control->source)
+            fields.push_back(std::make_pair("If-Range", control->if_range));
+          control->if_range.clear();
+        }
+        else if (!control->buffer && control->options.segments > 1)
+        {
+          // ask for a range, so we find out if the server will do the other segments
+          segments = std::make_shared<segment_set>(target, mirrors, mirror);
+          fields.push_back(std::make_pair("Range", "bytes=0-"));
+        }
+        info = NULL;
+        control->source = source;
+        // segments go straight to wherever the first stream was redirected to
+        r = pooled_get(segments ? segments->target : target, client, [&](download_client &c) { c.start_transfer(control, &f, existing_size, segments); }, fields, &info);
+        if (segments)
+          target = segments->target;
+        if (segments && segments->has_started())
+          break;
+        const bool ok = r && info && (info->m_response_code == 200 || info->m_response_code == 206) && client->is_complete();
+        if (ok || control->stop || client->has_local_error() || control->buffer || urls.size() == 1)
+          break;
+
+        // what we have on disk is good, ask the next mirror for the rest
+        client->end_transfer();
+        client->disconnect();
+        if (!f.flush())
+          break;
+        existing_size = f.tell();
+        if (control->options.hasher && control->options.hasher->size() != existing_size && (!control->options.hasher->reset() || (existing_size > 0 && !control->options.hasher->update_from_file(control->path, existing_size))))
+        {
+          MERROR("Failed to hash existing data in " << control->path);
+          break;
+        }
+        MWARNING("Download from " << target.pool_key << " failed, trying the next mirror from " << existing_size);
       }
-      if (!client.invoke_get(u_c.uri, std::chrono::seconds(30), "", &info, fields))
+      if (segments && segments->has_started())
       {
-        boost::lock_guard<boost::mutex> lock(control->mutex);
-        MERROR("Failed to connect to " << control->uri);
-        client.disconnect();
-        control->result_cb(control->path, control->uri, control->success);
-        return;
+        // we stop reading the first segment ourselves, the rest of that response is not wanted
+        segment_joiner.segments = segments;
+        const uint64_t got = client->get_total();
+        const bool done = client->is_segment_done(), local_error = client->has_local_error();
+        client->disconnect();
+        client->end_transfer();
+        segments->hashed_end = got;
+        if (!done)
+        {
+          // the rest of the first segment can come from another mirror, it just is not hashed as it comes
+          size_t next_mirror = mirror;
+          connection_target next_target;
+          if (control->stop || local_error || segments->failed || !f.flush() || !mirrors->next(next_mirror, true, next_target))
+            segments->failed = true;
+          else
+          {
+            MWARNING("First segment of " << control->uri << " failed, carrying on from " << got << " on " << next_target.pool_key);
+            download_segment(control, segments, got, segments->first_segment_end, next_target, next_mirror);
+          }
+        }
+        segments->join();
+        if (segments->failed || control->stop)
+        {
+          boost::lock_guard<boost::mutex> lock(control->mutex);
+          MERROR("Segmented download of " << control->uri << " failed");
+          // there will be holes, only what the hasher went over can be resumed from
+          if (!control->options.manifest || !f.trim() || !save_checkpoint(control, f))
+          {
+            f.close();
+            boost::system::error_code ec;
+            boost::filesystem::remove(control->path, ec);
+            if (control->options.manifest)
+              remove_manifest(control->path);
+          }
+          control->result_cb(control->path, control->uri, control->success);
+          return;
+        }
       }
-      if (control->stop)
+      else
       {
-        boost::lock_guard<boost::mutex> lock(control->mutex);
-        MDEBUG("Download cancelled");
-        client.disconnect();
-        control->result_cb(control->path, control->uri, control->success);
-        return;
+        // a cancelled download may have failed at any point, so this comes first
+        if (control->stop)
+        {
+          boost::lock_guard<boost::mutex> lock(control->mutex);
+          MDEBUG("Download cancelled");
+          client->disconnect();
+          report_result(control, f);
+          return;
+        }
+        if (!r)
+        {
+          boost::lock_guard<boost::mutex> lock(control->mutex);
+          MERROR("Failed to connect to " << control->uri);
+          client->disconnect();
+          report_result(control, f);
+          return;
+        }
+        if (!info)
+        {
+          boost::lock_guard<boost::mutex> lock(control->mutex);
+          MERROR("Failed invoking GET command to " << control->uri << ", no status info returned");
+          client->disconnect();
+          report_result(control, f);
+          return;
+        }
+        MDEBUG("response code: " << info->m_response_code);
+        MDEBUG("response length: " << info->m_header_info.m_content_length);
+        MDEBUG("response comment: " << info->m_response_comment);
+        MDEBUG("response body: " << info->m_body);
+        for (const auto &f: info->m_additional_fields)
+          MDEBUG("additional field: " << f.first << ": " << f.second);
+        const int response_code = info->m_response_code;
+        // a transfer we broke off ourselves still ends with a response
+        const bool complete = !client->has_local_error() && client->is_complete();
+        client->end_transfer();
+        get_connection_pool().give_back(target.pool_key, std::move(client));
+        if (response_code != 200 && response_code != 206)
+        {
+          boost::lock_guard<boost::mutex> lock(control->mutex);
+          MERROR("Status code " << response_code);
+          report_result(control, f);
+          return;
+        }
+        if (!complete)
+        {
+          boost::lock_guard<boost::mutex> lock(control->mutex);
+          MERROR("Download of " << control->uri << " did not complete");
+          report_result(control, f);
+          return;
+        }
       }
-      if (!info)
+      // the last of the data is only written out now
+      if (!control->buffer && !f.close())
       {
         boost::lock_guard<boost::mutex> lock(control->mutex);
-        MERROR("Failed invoking GET command to " << control->uri << ", no status info returned");
-        client.disconnect();
-        control->result_cb(control->path, control->uri, control->success);
+        MERROR("Failed to write " << control->path);
+        report_result(control, f);
         return;
       }
-      MDEBUG("response code: " << info->m_response_code);
-      MDEBUG("response length: " << info->m_header_info.m_content_length);
-      MDEBUG("response comment: " << info->m_response_comment);
-      MDEBUG("response body: " << info->m_body);
-      for (const auto &f: info->m_additional_fields)
-        MDEBUG("additional field: " << f.first << ": " << f.second);
-      if (info->m_response_code != 200 && info->m_response_code != 206)
+      if (segments && segments->file_size > 0 && control->options.hasher)
       {
-        boost::lock_guard<boost::mutex> lock(control->mutex);
-        MERROR("Status code " << info->m_response_code);
-        client.disconnect();
-        control->result_cb(control->path, control->uri, control->success);
-        return;
+        // the hasher followed the first stream, the rest is on disk now
+        const uint64_t tail = segments->file_size - segments->hashed_end;
+        if (!control->options.hasher->update_from_file(control->path, tail, segments->hashed_end))
+        {
+          boost::lock_guard<boost::mutex> lock(control->mutex);
+          MERROR("Failed to hash downloaded segments of " << control->path);
+          report_result(control, f);
+          return;
+        }
       }
-      client.disconnect();
-      f.close();
       MDEBUG("Download complete");
       lock.lock();
       control->success = true;
-      control->result_cb(control->path, control->uri, control->success);
+      report_result(control, f);
       return;
     }
     catch (const std::exception &e)
@@ -258,21 +1704,91 @@ namespace tools
     control->result_cb(control->path, control->uri, control->success);
   }
 
-  bool download(const std::string &path, const std::string &url, std::function<bool(const std::string&, const std::string&, size_t, ssize_t)> cb)
+  bool download(const std::string &path, const std::string &url, std::function<bool(const std::string&, const std::string&, size_t, ssize_t)> cb, const download_options &options)
+  {
+    bool success = false;
+    download_async_handle control = std::make_shared<download_thread_control>(path, url, [&success](const std::string&, const std::string&, bool result) {success = result;}, cb, options);
+    // the caller is waiting anyway, no need for another thread
+    download_thread(control);
+    return success;
+  }
+
+  bool download_to_buffer(const std::string &url, std::string &buffer, size_t max_size, std::function<bool(const std::string&, const std::string&, size_t, ssize_t)> progress, std::chrono::steady_clock::time_point deadline)
   {
     bool success = false;
-    download_async_handle handle = download_async(path, url, [&success](const std::string&, const std::string&, bool result) {success = result;}, cb);
-    download_wait(handle);
+    download_options options;
+    options.deadline = deadline;
+    download_async_handle control = std::make_shared<download_thread_control>("", url, [&success](const std::string&, const std::string&, bool result) {success = result;}, progress, options);
+    control->buffer = &buffer;
+    control->max_size = max_size;
+    // small enough to not be worth a thread of its own
+    download_thread(control);
     return success;
   }
 
-  download_async_handle download_async(const std::string &path, const std::string &url, std::function<void(const std::string&, const std::string&, bool)> result, std::function<bool(const std::string&, const std::string&, size_t, ssize_t)> progress)
+  // queued downloads count as active already, so cancelling all of them does
+  // not leave those to run once a worker frees up
+  static void submit_download(const download_async_handle &control)
+  {
+    {
+      boost::lock_guard<boost::mutex> lock(active_downloads_mutex);
+      active_downloads.insert(control);
+    }
+    if (!download_worker_pool::instance().submit([control]() { download_thread(control); }))
+    {
+      // too late, it fails right away
+      control->stop = true;
+      download_thread(control);
+    }
+  }
+
+  download_async_handle download_to_buffer_async(const std::string &url, std::string &buffer, size_t max_size, std::function<void(const std::string&, const std::string&, bool)> result, std::chrono::steady_clock::time_point deadline)
+  {
+    download_options options;
+    options.deadline = deadline;
+    download_async_handle control = std::make_shared<download_thread_control>("", url, result, nullptr, options);
+    control->buffer = &buffer;
+    control->max_size = max_size;
+    submit_download(control);
+    return control;
+  }
+
+  download_async_handle download_async(const std::string &path, const std::string &url, std::function<void(const std::string&, const std::string&, bool)> result, std::function<bool(const std::string&, const std::string&, size_t, ssize_t)> progress, const download_options &options)
   {
-    download_async_handle control = std::make_shared<download_thread_control>(path, url, result, progress);
-    control->thread = boost::thread([control](){ download_thread(control); });
+    download_async_handle control = std::make_shared<download_thread_control>(path, url, result, progress, options);
+    submit_download(control);
     return control;
   }
 
+  download_progress get_download_progress(const download_async_handle &control)
+  {
+    download_progress progress = {0, 0, 0};
+    CHECK_AND_ASSERT_MES(control != 0, progress, "NULL async download handle");
+    progress.downloaded = control->downloaded.load(std::memory_order_relaxed);
+    progress.total = control->total.load(std::memory_order_relaxed);
+    progress.received = control->received.load(std::memory_order_relaxed);
+    return progress;
+  }
+
+  download_pool_stats get_download_pool_stats()
+  {
+    download_pool_stats stats = get_connection_pool().get_stats();
+    const epee::net_utils::ssl_session_stats ssl_stats = epee::net_utils::get_ssl_session_stats();
+    stats.tls_handshakes = ssl_stats.handshakes;
+    stats.tls_resumed = ssl_stats.resumed;
+    return stats;
+  }
+
+  void set_download_session_resumption(bool enable)
+  {
+    session_resumption = enable;
+  }
+
+  void set_download_rate_limit(uint64_t bytes_per_second)
+  {
+    get_global_rate_limiter().set_rate(bytes_per_second);
+  }
+
   bool download_finished(const download_async_handle &control)
   {
     CHECK_AND_ASSERT_MES(control != 0, false, "NULL async download handle");
@@ -290,13 +1806,25 @@ namespace tools
   bool download_wait(const download_async_handle &control)
   {
     CHECK_AND_ASSERT_MES(control != 0, false, "NULL async download handle");
+    boost::unique_lock<boost::mutex> lock(control->mutex);
+    while (!control->stopped)
+      control->stopped_cond.wait(lock);
+    return true;
+  }
+
+  // sets the stop flag, and fails whatever the download is blocked on so it sees it now
+  static void stop_download(const download_async_handle &control)
+  {
+    std::vector<download_async_handle> probes;
     {
-      boost::lock_guard<boost::mutex> lock(control->mutex);
-      if (control->stopped)
-        return true;
+      boost::lock_guard<boost::mutex> lock(control->clients_mutex);
+      control->stop = true;
+      for (download_client *client: control->clients)
+        client->interrupt();
+      probes = control->probes;
     }
-    control->thread.join();
-    return true;
+    for (const download_async_handle &probe: probes)
+      stop_download(probe);
   }
 
   bool download_cancel(const download_async_handle &control)
@@ -306,9 +1834,33 @@ namespace tools
       boost::lock_guard<boost::mutex> lock(control->mutex);
       if (control->stopped)
         return true;
-      control->stop = true;
     }
-    control->thread.join();
-    return true;
+    stop_download(control);
+    return download_wait(control);
+  }
+
+  void remove_partial_download(const std::string &path)
+  {
+    boost::system::error_code ec;
+    boost::filesystem::remove(path, ec);
+    remove_manifest(path);
+  }
+
+  static std::set<download_async_handle> stop_active_downloads()
+  {
+    std::set<download_async_handle> downloads;
+    {
+      boost::lock_guard<boost::mutex> lock(active_downloads_mutex);
+      downloads = active_downloads;
+    }
+    for (const download_async_handle &control: downloads)
+      stop_download(control);
+    return downloads;
+  }
+
+  void download_cancel_all()
+  {
+    for (const download_async_handle &control: stop_active_downloads())
+      download_wait(control);
   }
 }
@@ -28,17 +28,89 @@
 
 #pragma once 
 
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <stdint.h>
 #include <string>
+#include <vector>
 
 namespace tools
 {
+  class sha256_hasher;
+
   struct download_thread_control;
   typedef std::shared_ptr<download_thread_control> download_async_handle;
 
-  bool download(const std::string &path, const std::string &url, std::function<bool(const std::string&, const std::string&, size_t, ssize_t)> progress = NULL);
-  download_async_handle download_async(const std::string &path, const std::string &url, std::function<void(const std::string&, const std::string&, bool)> result, std::function<bool(const std::string&, const std::string&, size_t, ssize_t)> progress = NULL);
+  struct download_options
+  {
+    download_options(): segments(1), manifest(false), max_rate(0), idle_only(false), deadline(std::chrono::steady_clock::time_point::max()) {}
+
+    //! if set, every byte of the file is fed to it as it is written, including
+    //! any part of it which was already on disk when resuming
+    std::shared_ptr<sha256_hasher> hasher;
+    //! fetch the file over this many concurrent ranges, if the server supports them
+    unsigned int segments;
+    //! other URLs serving the same file. They race the main URL to answer first, and
+    //! a transfer which fails part way carries on from the next one with a range.
+    //! Nothing checks they agree, so only use this if the content is verified after.
+    std::vector<std::string> mirrors;
+    //! keep a manifest next to the file (its path + ".manifest") while downloading, so
+    //! a later download of the same URL to the same path carries on from where this one
+    //! stopped, without rehashing what is on disk. Needs a hasher. A file without a
+    //! valid manifest is downloaded again from the start.
+    bool manifest;
+    //! receive no faster than this many bytes per second, 0 for no limit. It is
+    //! shared by all segments, and applies on top of set_download_rate_limit.
+    uint64_t max_rate;
+    //! slow right down while other traffic goes through the network interfaces,
+    //! so the download only takes bandwidth nothing else wants (Linux only)
+    bool idle_only;
+    //! give up if the download is not done by then. Every connect, send and receive
+    //! also has a timeout of its own, this bounds the whole thing.
+    std::chrono::steady_clock::time_point deadline;
+  };
+
+  struct download_pool_stats
+  {
+    uint64_t hits;   //!< requests which reused an idle keep-alive connection
+    uint64_t misses; //!< requests which needed a new connection
+    uint64_t idle;   //!< connections currently kept alive
+    uint64_t tls_handshakes; //!< TLS handshakes done by clients in this process
+    uint64_t tls_resumed;    //!< how many of those resumed a cached session
+  };
+
+  //! how far a download got, counting what was already on disk when resuming
+  struct download_progress
+  {
+    uint64_t downloaded;
+    uint64_t total;    //!< 0 until the size is known
+    uint64_t received; //!< over the network by this download, for working out its rate
+  };
+
+  bool download(const std::string &path, const std::string &url, std::function<bool(const std::string&, const std::string&, size_t, ssize_t)> progress = NULL, const download_options &options = download_options());
+  //! download a small file straight into `buffer`, failing if it is larger than `max_size` or not done by `deadline`
+  bool download_to_buffer(const std::string &url, std::string &buffer, size_t max_size, std::function<bool(const std::string&, const std::string&, size_t, ssize_t)> progress = NULL, std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max());
+  //! download_to_buffer on another thread, `buffer` must be kept until the download is finished
+  download_async_handle download_to_buffer_async(const std::string &url, std::string &buffer, size_t max_size, std::function<void(const std::string&, const std::string&, bool)> result, std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max());
+  download_async_handle download_async(const std::string &path, const std::string &url, std::function<void(const std::string&, const std::string&, bool)> result, std::function<bool(const std::string&, const std::string&, size_t, ssize_t)> progress = NULL, const download_options &options = download_options());
+  //! reads a download's counters without blocking it, so it can be polled at whatever pace suits.
+  //! This is cheaper than a progress callback, which can be called several times per read, and
+  //! concurrently for segmented downloads.
+  download_progress get_download_progress(const download_async_handle &h);
+  download_pool_stats get_download_pool_stats();
+  //! let HTTPS downloads resume TLS sessions from earlier connections to the same host (off by default)
+  void set_download_session_resumption(bool enable);
+  //! receive no faster than this many bytes per second over all downloads together, 0 for no limit
+  void set_download_rate_limit(uint64_t bytes_per_second);
   bool download_error(const download_async_handle &h);
   bool download_finished(const download_async_handle &h);
   bool download_wait(const download_async_handle &h);
+  //! stop a download and wait for it to be done. Connections it is waiting on are
+  //! closed under it, so this does not wait for their timeouts.
   bool download_cancel(const download_async_handle &h);
+  //! stop every download in progress, and wait for them to be done
+  void download_cancel_all();
+  //! remove a partial download, and its manifest if it has one
+  void remove_partial_download(const std::string &path);
 }
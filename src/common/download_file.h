@@ -0,0 +1,254 @@
+// Copyright (c) 2017-2019, The Monero Project
+// 
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without modification, are
+// permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice, this list
+//    of conditions and the following disclaimer in the documentation and/or other
+//    materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its contributors may be
+//    used to endorse or promote products derived from this software without specific
+//    prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+// THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+// STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+// THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#include <algorithm>
+#include <memory>
+#include <string>
+#include "misc_log_ex.h"
+#include "span.h"
+
+#undef MONERO_DEFAULT_LOG_CATEGORY
+#define MONERO_DEFAULT_LOG_CATEGORY "net.dl"
+
+// received data is gathered into writes of this size
+#define WRITE_BUFFER_SIZE (1024 * 1024)
+#define WRITE_BUFFER_ALIGNMENT 4096
+
+namespace tools
+{
+  // A file being downloaded to, written at an explicit offset. Data is staged in
+  // a page aligned buffer and written out in large blocks, and disk space can be
+  // reserved up front so the file does not grow one small write at a time.
+  class download_file
+  {
+  public:
+    download_file(): fd(-1), buffer(NULL), offset(0), used(0), error(false), reserved(false) {}
+    ~download_file() { close(); }
+
+    //! opens `path` for writing at `position`, emptying it first if `truncate`
+    bool open(const std::string &path, bool truncate, uint64_t position)
+    {
+      close();
+#ifdef _WIN32
+      fd = _open(path.c_str(), _O_WRONLY | _O_CREAT | _O_BINARY | (truncate ? _O_TRUNC : 0), _S_IREAD | _S_IWRITE);
+#else
+      fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (truncate ? O_TRUNC : 0), 0666);
+#endif
+      offset = position;
+      used = 0;
+      error = fd < 0;
+      reserved = false;
+      return !error;
+    }
+    bool good() const { return fd >= 0 && !error; }
+    //! where the next write goes
+    uint64_t tell() const { return offset + used; }
+
+    //! where the next write goes in the staging buffer, data can be put there
+    //! and then passed to write without being copied
+    epee::span<char> get_write_buffer()
+    {
+      if (!good())
+        return nullptr;
+      allocate();
+      return {buffer + used, WRITE_BUFFER_SIZE - used};
+    }
+
+    bool write(const char *data, size_t size)
+    {
+      if (!good())
+        return false;
+      allocate();
+      while (size > 0)
+      {
+        const size_t n = std::min(size, (size_t)WRITE_BUFFER_SIZE - used);
+        if (data != buffer + used)
+          memcpy(buffer + used, data, n);
+        used += n;
+        data += n;
+        size -= n;
+        if (used == WRITE_BUFFER_SIZE && !flush())
+          return false;
+      }
+      return true;
+    }
+
+    bool flush()
+    {
+      if (!good())
+        return false;
+      if (used > 0)
+      {
+        error = !write_at(buffer, used, offset);
+        offset += used;
+        used = 0;
+      }
+      return !error;
+    }
+
+    //! flushes, and waits for the data to be on disk
+    bool sync()
+    {
+      if (!flush())
+        return false;
+#if defined(_WIN32)
+      error = _commit(fd) != 0;
+#elif defined(__linux__)
+      error = fdatasync(fd) != 0;
+#else
+      error = fsync(fd) != 0;
+#endif
+      return !error;
+    }
+
+    //! cuts the file off at the current position
+    bool trim()
+    {
+      if (flush() && !set_size(tell()))
+        error = true;
+      return good();
+    }
+
+    //! empties the file, dropping anything not written yet
+    bool truncate()
+    {
+      used = 0;
+      offset = 0;
+      if (good() && !set_size(0))
+        error = true;
+      return good();
+    }
+
+    //! reserves disk space for the file to grow to `size`, without changing its size
+    void reserve(uint64_t size)
+    {
+#ifdef __linux__
+      if (good() && fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size) == 0)
+        reserved = true;
+      else
+        MDEBUG("Failed to reserve " << size << " bytes: " << strerror(errno));
+#endif
+    }
+
+    //! sets the size of the file, with its blocks allocated where possible
+    bool resize(uint64_t size)
+    {
+      if (!good() || !set_size(size))
+        return false;
+#ifdef __linux__
+      if (fallocate(fd, 0, 0, size) != 0)
+        MDEBUG("Failed to allocate " << size << " bytes: " << strerror(errno));
+#endif
+      return true;
+    }
+
+    bool close()
+    {
+      if (fd < 0)
+        return false;
+      const bool ok = flush();
+#ifndef _WIN32
+      // a failed download would otherwise keep the rest of the reservation
+      struct stat st;
+      if (reserved && fstat(fd, &st) == 0)
+        set_size(st.st_size);
+#endif
+#ifdef _WIN32
+      const bool closed = _close(fd) == 0;
+#else
+      const bool closed = ::close(fd) == 0;
+#endif
+      fd = -1;
+      error = !ok || !closed;
+      return !error;
+    }
+
+  private:
+    void allocate()
+    {
+      if (buffer)
+        return;
+      storage.reset(new char[WRITE_BUFFER_SIZE + WRITE_BUFFER_ALIGNMENT]);
+      buffer = storage.get() + (WRITE_BUFFER_ALIGNMENT - (uintptr_t)storage.get() % WRITE_BUFFER_ALIGNMENT) % WRITE_BUFFER_ALIGNMENT;
+    }
+
+    bool write_at(const char *data, size_t size, uint64_t position)
+    {
+      while (size > 0)
+      {
+#ifdef _WIN32
+        if (_lseeki64(fd, position, SEEK_SET) < 0)
+          return false;
+        const int written = _write(fd, data, size);
+#else
+        const ssize_t written = pwrite(fd, data, size, position);
+#endif
+        if (written < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          MERROR("Failed to write " << size << " bytes at " << position << ": " << strerror(errno));
+          return false;
+        }
+        data += written;
+        size -= written;
+        position += written;
+      }
+      return true;
+    }
+
+    bool set_size(uint64_t size)
+    {
+#ifdef _WIN32
+      return _chsize_s(fd, size) == 0;
+#else
+      return ftruncate(fd, size) == 0;
+#endif
+    }
+
+    int fd;
+    std::unique_ptr<char[]> storage;
+    char *buffer;
+    uint64_t offset; // of the start of the buffer
+    size_t used;
+    bool error;
+    bool reserved;
+  };
+}
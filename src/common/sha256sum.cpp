@@ -26,53 +26,219 @@
 // STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
 // THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
-#include <openssl/sha.h>
+#include <string.h>
+#include <algorithm>
+#include <openssl/evp.h>
 #include "file_io_utils.h"
 #include "sha256sum.h"
 
+#if OPENSSL_VERSION_NUMBER < 0x10100000L || (defined(LIBRESSL_VERSION_NUMBER) && LIBRESSL_VERSION_NUMBER < 0x2070000fL)
+#define EVP_MD_CTX_new EVP_MD_CTX_create
+#define EVP_MD_CTX_free EVP_MD_CTX_destroy
+#endif
+
+// version byte of sha256_hasher::get_state
+#define SHA256_STATE_VERSION 1
+
 namespace tools
 {
+  static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+  };
+
+  static inline uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+  static inline uint32_t get_be32(const uint8_t *p)
+  {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+  }
+
+  static inline void put_be32(uint8_t *p, uint32_t v)
+  {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+  }
+
+  static void put_be64(uint8_t *p, uint64_t v)
+  {
+    put_be32(p, v >> 32);
+    put_be32(p + 4, v);
+  }
+
+  // one go, nothing to save: EVP is faster than the in-tree hasher
   bool sha256sum(const uint8_t *data, size_t len, uint8_t hash[32])
   {
-    SHA256_CTX ctx;
-    if (!SHA256_Init(&ctx))
-      return false;
-    if (!SHA256_Update(&ctx, data, len))
-      return false;
-    if (!SHA256_Final((unsigned char*)hash, &ctx))
-      return false;
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    const bool r = ctx && EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) && EVP_DigestUpdate(ctx, data, len) && EVP_DigestFinal_ex(ctx, (unsigned char*)hash, NULL);
+    EVP_MD_CTX_free(ctx);
+    return r;
+  }
+
+  bool sha256_hasher::reset()
+  {
+    static const uint32_t iv[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    memcpy(h, iv, sizeof(h));
+    total = 0;
     return true;
   }
 
-  bool sha256sum(const std::string &filename, uint8_t hash[32])
+  void sha256_hasher::compress(const uint8_t *block)
+  {
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i)
+      w[i] = get_be32(block + 4 * i);
+    for (int i = 16; i < 64; ++i)
+    {
+      const uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      const uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+    for (int i = 0; i < 64; ++i)
+    {
+      const uint32_t t1 = hh + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+      const uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+      hh = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+    h[5] += f;
+    h[6] += g;
+    h[7] += hh;
+  }
+
+  bool sha256_hasher::update(const void *data, size_t len)
+  {
+    const uint8_t *p = (const uint8_t*)data;
+    size_t used = total % 64;
+    total += len;
+    if (used)
+    {
+      const size_t n = std::min(len, 64 - used);
+      memcpy(pending + used, p, n);
+      p += n;
+      len -= n;
+      if (used + n < 64)
+        return true;
+      compress(pending);
+    }
+    for (; len >= 64; p += 64, len -= 64)
+      compress(p);
+    memcpy(pending, p, len);
+    return true;
+  }
+
+  bool sha256_hasher::update_from_file(const std::string &filename, uint64_t size, uint64_t offset)
   {
     if (!epee::file_io_utils::is_file_exist(filename))
       return false;
     std::ifstream f;
     f.exceptions(std::ifstream::failbit | std::ifstream::badbit);
-    f.open(filename, std::ios_base::binary | std::ios_base::in | std::ios::ate);
+    f.open(filename, std::ios_base::binary | std::ios_base::in);
     if (!f)
       return false;
-    std::ifstream::pos_type file_size = f.tellg();
-    SHA256_CTX ctx;
-    if (!SHA256_Init(&ctx))
-      return false;
-    size_t size_left = file_size;
-    f.seekg(0, std::ios::beg);
+    f.seekg(offset);
+    uint64_t size_left = size;
     while (size_left)
     {
-      char buf[4096];
+      char buf[65536];
       std::ifstream::pos_type read_size = size_left > sizeof(buf) ? sizeof(buf) : size_left;
       f.read(buf, read_size);
       if (!f || !f.good())
         return false;
-      if (!SHA256_Update(&ctx, buf, read_size))
+      if (!update(buf, read_size))
         return false;
       size_left -= read_size;
     }
     f.close();
-    if (!SHA256_Final((unsigned char*)hash, &ctx))
+    return true;
+  }
+
+  bool sha256_hasher::finalize(uint8_t hash[32])
+  {
+    const uint64_t bits = total * 8;
+    uint8_t padding[72] = { 0x80 };
+    const size_t padding_size = (total % 64 < 56 ? 56 : 120) - total % 64;
+    put_be64(padding + padding_size, bits);
+    update(padding, padding_size + 8);
+    for (int i = 0; i < 8; ++i)
+      put_be32(hash + 4 * i, h[i]);
+    return true;
+  }
+
+  std::string sha256_hasher::get_state() const
+  {
+    uint8_t s[1 + 32 + 8];
+    s[0] = SHA256_STATE_VERSION;
+    for (int i = 0; i < 8; ++i)
+      put_be32(s + 1 + 4 * i, h[i]);
+    put_be64(s + 33, total);
+    return std::string((const char*)s, sizeof(s)) + std::string((const char*)pending, total % 64);
+  }
+
+  bool sha256_hasher::set_state(const std::string &state)
+  {
+    const uint8_t *s = (const uint8_t*)state.data();
+    if (state.size() < 1 + 32 + 8 || s[0] != SHA256_STATE_VERSION)
+      return false;
+    const uint64_t t = ((uint64_t)get_be32(s + 33) << 32) | get_be32(s + 37);
+    // the bytes short of a block must be all there is after the header
+    if (state.size() != 1 + 32 + 8 + t % 64)
       return false;
+    for (int i = 0; i < 8; ++i)
+      h[i] = get_be32(s + 1 + 4 * i);
+    total = t;
+    memcpy(pending, s + 41, t % 64);
     return true;
   }
+
+  // one go, nothing to save: EVP is faster than the in-tree hasher
+  bool sha256sum(const std::string &filename, uint8_t hash[32])
+  {
+    uint64_t file_size;
+    if (!epee::file_io_utils::get_file_size(filename, file_size))
+      return false;
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    bool r = ctx && EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+    try
+    {
+      std::ifstream f;
+      f.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+      f.open(filename, std::ios_base::binary | std::ios_base::in);
+      while (r && file_size)
+      {
+        char buf[65536];
+        const size_t read_size = file_size > sizeof(buf) ? sizeof(buf) : file_size;
+        f.read(buf, read_size);
+        r = EVP_DigestUpdate(ctx, buf, read_size);
+        file_size -= read_size;
+      }
+    }
+    catch (const std::exception &e)
+    {
+      r = false;
+    }
+    r = r && EVP_DigestFinal_ex(ctx, (unsigned char*)hash, NULL);
+    EVP_MD_CTX_free(ctx);
+    return r;
+  }
 }
@@ -33,5 +33,34 @@
 
 namespace tools
 {
+  //! Incremental SHA-256, for hashing data as it streams in. This one is in-tree
+  //! rather than EVP, so its state can be saved, and carried on from later, maybe
+  //! in another process
+  class sha256_hasher
+  {
+  public:
+    sha256_hasher() { reset(); }
+
+    bool reset();
+    bool update(const void *data, size_t len);
+    //! hash `size` bytes of a file, starting at `offset`
+    bool update_from_file(const std::string &filename, uint64_t size, uint64_t offset = 0);
+    bool finalize(uint8_t hash[32]);
+
+    //! number of bytes hashed since the last reset
+    uint64_t size() const { return total; }
+    //! the state so far, in a fixed encoding: a version byte, the eight state words
+    //! and the byte count big endian, then the bytes short of a whole block
+    std::string get_state() const;
+    bool set_state(const std::string &state);
+
+  private:
+    void compress(const uint8_t *block);
+
+    uint32_t h[8];
+    uint64_t total;
+    uint8_t pending[64]; // total % 64 bytes not hashed yet
+  };
+
   bool sha256sum(const std::string &filename, uint8_t hash[32]);
 }
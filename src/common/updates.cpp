@@ -99,7 +99,11 @@ namespace tools
 
   std::string get_update_url(const std::string &software, const std::string &subdir, const std::string &buildtag, const std::string &version, bool user)
   {
-    const char *base = user ? "https://downloads.getmonero.org/" : "https://updates.getmonero.org/";
+    return get_mirror_update_url(software, subdir, buildtag, version, user ? "https://downloads.getmonero.org/" : "https://updates.getmonero.org/");
+  }
+
+  std::string get_mirror_update_url(const std::string &software, const std::string &subdir, const std::string &buildtag, const std::string &version, const std::string &base)
+  {
 #ifdef _WIN32
     static const char *extension = strncmp(buildtag.c_str(), "install-", 8) ? ".zip" : ".exe";
 #else
@@ -109,6 +113,8 @@ namespace tools
     std::string url;
 
     url =  base;
+    if (!url.empty() && url.back() != '/')
+      url += "/";
     if (!subdir.empty())
       url += subdir + "/";
     url = url + software + "-" + buildtag + "-v" + version + extension;
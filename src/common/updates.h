@@ -34,4 +34,6 @@ namespace tools
 {
   bool check_updates(const std::string &software, const std::string &buildtag, std::string &version, std::string &hash);
   std::string get_update_url(const std::string &software, const std::string &subdir, const std::string &buildtag, const std::string &version, bool user);
+  //! the same file, on a mirror of the download site rooted at `base`
+  std::string get_mirror_update_url(const std::string &software, const std::string &subdir, const std::string &buildtag, const std::string &version, const std::string &base);
 }
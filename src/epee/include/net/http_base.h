@@ -30,8 +30,10 @@
 #include <boost/lexical_cast.hpp>
 #include <boost/regex.hpp>
 #include <boost/utility/string_ref.hpp>
+#include <list>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "string_tools.h"
 
@@ -63,7 +65,7 @@ namespace net_utils
 			http_content_type_not_set
 		};
 
-		typedef std::list<std::pair<std::string, std::string> > fields_list;
+		typedef std::vector<std::pair<std::string, std::string> > fields_list;
 
 		inline
 		std::string get_value_from_fields_list(const std::string& param_name, const net_utils::http::fields_list& fields)
@@ -195,10 +197,17 @@ namespace net_utils
 			int                 m_http_ver_hi;// OUT paramter only
 			int                 m_http_ver_lo;// OUT paramter only
 
+			// keeps the header strings' storage, so a reused client does not reallocate them
 			void clear()
 			{
-				this->~http_response_info();
-				new(this) http_response_info();
+				m_response_code = 0;
+				m_response_comment.clear();
+				m_additional_fields.clear();
+				std::string().swap(m_body);
+				m_mime_tipe.clear();
+				m_header_info.clear();
+				m_http_ver_hi = 0;
+				m_http_ver_lo = 0;
 			}
 		};
 	}
@@ -29,14 +29,20 @@
 #pragma once
 #include <ctype.h>
 #include <boost/shared_ptr.hpp>
+#include <boost/algorithm/string/case_conv.hpp>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/algorithm/string/trim.hpp>
 #include <boost/regex.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/optional/optional.hpp>
 #include <boost/utility/string_ref.hpp>
 //#include <mbstring.h>
 #include <algorithm>
+#include <array>
 #include <cctype>
 #include <functional>
+#include <limits>
+#include <string.h>
 
 #include "net_helper.h"
 #include "http_client_base.h"
@@ -256,6 +262,7 @@ namespace net_utils
 			enum chunked_state{
 				http_chunked_state_chunk_head,
 				http_chunked_state_chunk_body,
+				http_chunked_state_chunk_trailer,
 				http_chunked_state_done,
 				http_chunked_state_undefined
 			};
@@ -274,6 +281,10 @@ namespace net_utils
 			reciev_machine_state m_state;
 			chunked_state m_chunked_state;
 			std::string m_chunked_cache;
+			std::string m_recv_buffer; // reused for every read, body data is handed out as spans into it
+			size_t m_recv_buffer_min;
+			size_t m_recv_buffer_max;
+			bool m_identity_encoding; // the body is passed on as it comes, and can be read in place
 			bool m_auto_connect;
 			critical_section m_lock;
 
@@ -292,6 +303,10 @@ namespace net_utils
 				, m_state()
 				, m_chunked_state()
 				, m_chunked_cache()
+				, m_recv_buffer()
+				, m_recv_buffer_min(16 * 1024)
+				, m_recv_buffer_max(1024 * 1024)
+				, m_identity_encoding(true)
 				, m_auto_connect(true)
 				, m_lock()
 			{}
@@ -318,6 +333,15 @@ namespace net_utils
 				m_net_client.set_ssl(std::move(ssl_options));
 			}
 
+			//! Reads start at `min` bytes and grow up to `max` while they keep filling the buffer.
+			//! May be called from a body handler, it applies from the next read.
+			void set_recv_buffer_size(size_t min, size_t max)
+			{
+				CRITICAL_REGION_LOCAL(m_lock);
+				m_recv_buffer_min = std::max<size_t>(min, 1);
+				m_recv_buffer_max = std::max(max, m_recv_buffer_min);
+			}
+
 			void set_auto_connect(bool auto_connect)
 			{
 				m_auto_connect = auto_connect;
@@ -348,11 +372,22 @@ namespace net_utils
 				return m_net_client.is_connected(ssl);
 			}
 			//---------------------------------------------------------------------------
-			virtual bool handle_target_data(std::string& piece_of_transfer)
+			void set_deadline(std::chrono::steady_clock::time_point deadline)
+			{
+				CRITICAL_REGION_LOCAL(m_lock);
+				m_net_client.set_deadline(deadline);
+			}
+			//---------------------------------------------------------------------------
+			//! May be called from any thread, while a request is in progress
+			void interrupt()
+			{
+				m_net_client.interrupt();
+			}
+			//---------------------------------------------------------------------------
+			virtual bool handle_target_data(span<const char> piece_of_transfer)
 			{
 				CRITICAL_REGION_LOCAL(m_lock);
-				m_response_info.m_body += piece_of_transfer;
-        piece_of_transfer.clear();
+				m_response_info.m_body.append(piece_of_transfer.data(), piece_of_transfer.size());
 				return true;
 			}
 			//---------------------------------------------------------------------------
@@ -478,16 +513,57 @@ namespace net_utils
 				CRITICAL_REGION_LOCAL(m_lock);
 				bool keep_handling = true;
 				bool need_more_data = true;
-				std::string recv_buffer;
+				// the maximum was lowered since the last response, the memory can go
+				if (m_recv_buffer.size() > m_recv_buffer_max)
+					std::string().swap(m_recv_buffer);
+				if (m_recv_buffer.size() < m_recv_buffer_min)
+					m_recv_buffer.resize(m_recv_buffer_min);
+				span<const char> recv_buffer;
 				while(keep_handling)
 				{
 					if(need_more_data)
 					{
-						if(!m_net_client.recv(recv_buffer, timeout))
+						// never read past a delimited body, the connection may be reused
+						size_t read_size = std::min(m_recv_buffer.size(), m_recv_buffer_max);
+						if (m_state == reciev_machine_state_body_content_len && m_len_in_remain > 0)
+							read_size = std::min(read_size, m_len_in_remain);
+						size_t received = 0;
+						// a plain body can be read straight to where it is going, with
+						// whatever does not fit there going to our own buffer
+						span<char> target = nullptr;
+						if (m_state == reciev_machine_state_body_content_len && m_len_in_remain > 0 && m_identity_encoding)
+							target = get_target_buffer();
+						const size_t target_size = std::min(target.size(), read_size);
+						bool r;
+						if (target_size > 0)
+						{
+							const std::array<boost::asio::mutable_buffer, 2> buffers = {{
+								boost::asio::buffer(target.data(), target_size),
+								boost::asio::buffer(&m_recv_buffer[0], read_size - target_size)
+							}};
+							r = m_net_client.recv(buffers, received, timeout);
+						}
+						else
+							r = m_net_client.recv(&m_recv_buffer[0], read_size, received, timeout);
+						if(!r)
 						{
 							MERROR("Unexpected recv fail");
 							m_state = reciev_machine_state_error;
             }
+            // data is coming in faster than we read it, read more at a time
+            if (received == m_recv_buffer.size() && m_recv_buffer.size() < m_recv_buffer_max)
+              m_recv_buffer.resize(std::min(m_recv_buffer.size() * 2, m_recv_buffer_max));
+            const size_t received_in_target = std::min(received, target_size);
+            if (received_in_target > 0)
+            {
+              span<const char> target_data(target.data(), received_in_target);
+              need_more_data = false;
+              keep_handling = handle_body_content_len(target_data, need_more_data);
+              received -= received_in_target;
+              if (!keep_handling || !received)
+                continue;
+            }
+            recv_buffer = span<const char>(m_recv_buffer.data(), received);
             if(!recv_buffer.size())
             {
               //connection is going to be closed
@@ -537,7 +613,7 @@ namespace net_utils
 			}
 			//---------------------------------------------------------------------------
 			inline
-				bool handle_header(std::string& recv_buff, bool& need_more_data)
+				bool handle_header(span<const char>& recv_buff, bool& need_more_data)
 			{
  
 				CRITICAL_REGION_LOCAL(m_lock);
@@ -548,12 +624,15 @@ namespace net_utils
           return false;
         }
 
-				m_header_cache += recv_buff;
-				recv_buff.clear();
-				std::string::size_type pos = m_header_cache.find("\r\n\r\n");
+				// only look for the end of the header where it could be
+				const size_t search_from = m_header_cache.size() < 3 ? 0 : m_header_cache.size() - 3;
+				m_header_cache.append(recv_buff.data(), recv_buff.size());
+				std::string::size_type pos = m_header_cache.find("\r\n\r\n", search_from);
 				if(pos != std::string::npos)
 				{
-					recv_buff.assign(m_header_cache.begin()+pos+4, m_header_cache.end());
+					// whatever follows the header is body, and is still in the receive buffer
+					const size_t body_size = m_header_cache.size() - (pos + 4);
+					recv_buff.remove_prefix(recv_buff.size() - body_size);
 					m_header_cache.erase(m_header_cache.begin()+pos+4, m_header_cache.end());
 
 					analize_cached_header_and_invoke_state();
@@ -569,12 +648,15 @@ namespace net_utils
 
 					return true;
 				}else
+				{
+					recv_buff = nullptr;
 					need_more_data = true;
+				}
 				return true;
 			}
 			//---------------------------------------------------------------------------
 			inline
-				bool handle_body_content_len(std::string& recv_buff, bool& need_more_data)
+				bool handle_body_content_len(span<const char>& recv_buff, bool& need_more_data)
 			{
 				CRITICAL_REGION_LOCAL(m_lock);
 				if(!recv_buff.size())
@@ -600,7 +682,7 @@ namespace net_utils
 			}
 			//---------------------------------------------------------------------------
 			inline
-				bool handle_body_connection_close(std::string& recv_buff, bool& need_more_data)
+				bool handle_body_connection_close(span<const char>& recv_buff, bool& need_more_data)
 			{
 				CRITICAL_REGION_LOCAL(m_lock);
 				if(!recv_buff.size())
@@ -627,72 +709,52 @@ namespace net_utils
 			inline
 				bool get_len_from_chunk_head(const std::string &chunk_head, size_t& result_size)
 			{
-				std::stringstream str_stream;
-				str_stream << std::hex;
-				if(!(str_stream << chunk_head && str_stream >> result_size))
-					return false;
-
-				return true;
+				// hex digits, then optional whitespace and ;extensions, which we ignore
+				result_size = 0;
+				size_t digits = 0;
+				std::string::const_iterator it = chunk_head.begin();
+				for(; it != chunk_head.end() && is_hex_symbol(*it); ++it, ++digits)
+				{
+					if(result_size > (std::numeric_limits<size_t>::max() >> 4))
+						return false;
+					const char ch = *it;
+					result_size = (result_size << 4) | (ch <= '9' ? ch - '0' : (ch | 0x20) - 'a' + 10);
+				}
+				while(it != chunk_head.end() && (*it == ' ' || *it == '\t'))
+					++it;
+				return digits > 0 && (it == chunk_head.end() || *it == ';');
 			}
 			//---------------------------------------------------------------------------
+			// handles one complete line outside of chunk data, without its line ending
 			inline
-				bool get_chunk_head(std::string& buff, size_t& chunk_size, bool& is_matched)
+				bool handle_chunk_line(const std::string &line)
 			{
-				is_matched = false;
-				size_t offset = 0;
-				for(std::string::iterator it = buff.begin(); it!= buff.end(); it++, offset++)
+				if(m_chunked_state == http_chunked_state_chunk_trailer)
 				{
-					if(!is_hex_symbol(*it))
+					// trailer fields are ignored, an empty line ends the body
+					if(line.empty())
 					{
-						if(*it == '\r' || *it == ' ' )
-						{
-							offset--;
-							continue;
-						}
-						else if(*it == '\n')
-						{	
-							std::string chunk_head = buff.substr(0, offset);
-							if(!get_len_from_chunk_head(chunk_head, chunk_size))
-								return false;
-
-							if(0 == chunk_size)
-							{
-								//Here is a small confusion
-								//In brief - if the chunk is the last one we need to get terminating sequence
-								//along with the cipher, generally in the "ddd\r\n\r\n" form
-
-								for(it++;it != buff.end(); it++)
-								{
-									if('\r' == *it)
-										continue;
-									else if('\n' == *it)
-										break;
-									else
-									{
-										LOG_ERROR("http_stream_filter: Wrong last chunk terminator");
-										return false;
-									}
-								}
-
-								if(it == buff.end())
-									return true;
-							}
-
-							buff.erase(buff.begin(), ++it);
-
-							is_matched = true;				
-							return true;
-						}
-						else
-							return false;
+						m_chunked_state = http_chunked_state_done;
+						m_state = reciev_machine_state_done;
 					}
+					return true;
 				}
 
+				// the line ending after chunk data
+				if(line.empty())
+					return true;
+
+				if(!get_len_from_chunk_head(line, m_len_in_remain))
+				{
+					LOG_ERROR("http_stream_filter::handle_chunked(*) Failed to get length from chunked head:" << line);
+					return false;
+				}
+				m_chunked_state = m_len_in_remain ? http_chunked_state_chunk_body : http_chunked_state_chunk_trailer;
 				return true;
 			}
 			//---------------------------------------------------------------------------
 			inline
-				bool handle_body_body_chunked(std::string& recv_buff, bool& need_more_data)
+				bool handle_body_body_chunked(span<const char>& recv_buff, bool& need_more_data)
 			{
         CRITICAL_REGION_LOCAL(m_lock);
 				if(!recv_buff.size())
@@ -701,73 +763,53 @@ namespace net_utils
 					m_state = reciev_machine_state_done;
 					return true;
 				}
-				m_chunked_cache += recv_buff;
-				recv_buff.clear();
-				bool is_matched = false;
 
-				while(true)
+				// chunk data is passed on straight from the receive buffer, only a
+				// line split across reads is kept in m_chunked_cache
+				static const size_t max_chunk_line_size = 4096;
+				while(recv_buff.size())
 				{
-					if(!m_chunked_cache.size())
-					{
-						need_more_data = true;
-						break;
-					}
-
 					switch(m_chunked_state)
 					{
 					case http_chunked_state_chunk_head:
-						if(m_chunked_cache[0] == '\n' || m_chunked_cache[0] == '\r')
-						{
-							//optimize a bit
-							if(m_chunked_cache[0] == '\r' && m_chunked_cache.size()>1 && m_chunked_cache[1] == '\n')
-								m_chunked_cache.erase(0, 2);
-							else
-								m_chunked_cache.erase(0, 1);
-							break;
-						}
-						if(!get_chunk_head(m_chunked_cache, m_len_in_remain, is_matched))
+					case http_chunked_state_chunk_trailer:
 						{
-							LOG_ERROR("http_stream_filter::handle_chunked(*) Failed to get length from chunked head:" << m_chunked_cache);
-							m_state = reciev_machine_state_error;
-							return false;
-						}
-
-						if(!is_matched)
-						{
-							need_more_data = true;
-							return true;
-						}else
-						{
-							m_chunked_state = http_chunked_state_chunk_body;
-							if(m_len_in_remain == 0)
-							{//last chunk, let stop the stream and fix the chunk queue.
-								m_state = reciev_machine_state_done;
-								return true;
+							const char *eol = (const char*)memchr(recv_buff.data(), '\n', recv_buff.size());
+							const size_t len = eol ? eol - recv_buff.data() : recv_buff.size();
+							if(m_chunked_cache.size() + len > max_chunk_line_size)
+							{
+								LOG_ERROR("http_stream_filter::handle_chunked(*) Chunk line too long");
+								m_state = reciev_machine_state_error;
+								return false;
+							}
+							m_chunked_cache.append(recv_buff.data(), len);
+							recv_buff.remove_prefix(len);
+							if(!eol)
+								break;
+							recv_buff.remove_prefix(1);
+							if(!m_chunked_cache.empty() && m_chunked_cache.back() == '\r')
+								m_chunked_cache.pop_back();
+							const bool r = handle_chunk_line(m_chunked_cache);
+							m_chunked_cache.clear();
+							if(!r)
+							{
+								m_state = reciev_machine_state_error;
+								return false;
 							}
-							m_chunked_state = http_chunked_state_chunk_body;
-							break;
+							if(m_state == reciev_machine_state_done)
+								return true;
 						}
 						break;
 					case http_chunked_state_chunk_body:
 						{
-							std::string chunk_body;
-							if(m_len_in_remain >= m_chunked_cache.size())
-							{
-								m_len_in_remain -= m_chunked_cache.size();
-								chunk_body.swap(m_chunked_cache);
-							}else
-							{
-								chunk_body.assign(m_chunked_cache, 0, m_len_in_remain);
-								m_chunked_cache.erase(0, m_len_in_remain);
-								m_len_in_remain = 0;
-							}
-
-							if (!m_pcontent_encoding_handler->update_in(chunk_body))
+							const size_t chunk_size = std::min(m_len_in_remain, recv_buff.size());
+							if (!m_pcontent_encoding_handler->update_in(span<const char>(recv_buff.data(), chunk_size)))
 							{
 								m_state = reciev_machine_state_error;
 								return false;
 							}
-
+							recv_buff.remove_prefix(chunk_size);
+							m_len_in_remain -= chunk_size;
 							if(!m_len_in_remain)
 								m_chunked_state = http_chunked_state_chunk_head;
 						}
@@ -778,10 +820,38 @@ namespace net_utils
 					case http_chunked_state_undefined:
 					default:
 						LOG_ERROR("http_stream_filter::handle_chunked(): Wrong state" << m_chunked_state);
+						m_state = reciev_machine_state_error;
 						return false;
 					}
 				}
 
+				need_more_data = true;
+				return true;
+			}
+			//---------------------------------------------------------------------------
+			// FNV-1a over the lower cased name, so header names can be switched on
+			static constexpr uint64_t header_name_hash(const char *name, uint64_t hash = 0xcbf29ce484222325)
+			{
+				return *name ? header_name_hash(name + 1, (hash ^ (uint8_t)tolower_ascii(*name)) * 0x100000001b3) : hash;
+			}
+			static uint64_t header_name_hash(const boost::string_ref name)
+			{
+				uint64_t hash = 0xcbf29ce484222325;
+				for (const char c: name)
+					hash = (hash ^ (uint8_t)tolower_ascii(c)) * 0x100000001b3;
+				return hash;
+			}
+			static constexpr char tolower_ascii(const char c)
+			{
+				return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+			}
+			static bool header_name_equals(const boost::string_ref name, const boost::string_ref expected)
+			{
+				if (name.size() != expected.size())
+					return false;
+				for (size_t i = 0; i < name.size(); ++i)
+					if (tolower_ascii(name[i]) != tolower_ascii(expected[i]))
+						return false;
 				return true;
 			}
 			//---------------------------------------------------------------------------
@@ -820,33 +890,33 @@ namespace net_utils
 					CHECK_AND_ASSERT_MES(*ptr == '\n', true, "http_stream_filter::parse_cached_header() invalid header in: " << m_cache_to_process);
 					++ptr;
 
-					const std::string key = std::string(key_pos, key_end - key_pos);
-					const std::string value = std::string(value_pos, value_end - value_pos);
-					if (!key.empty())
+					const boost::string_ref key(key_pos, key_end - key_pos);
+					const boost::string_ref value(value_pos, value_end - value_pos);
+					if (key.empty())
+						continue;
+
+					// known fields are copied into strings which keep their storage between responses
+					std::string *field = NULL;
+					const char *name = NULL;
+					switch (header_name_hash(key))
 					{
-						if (!string_tools::compare_no_case(key, "Connection"))
-							body_info.m_connection = value;
-						else if(!string_tools::compare_no_case(key, "Referrer"))
-							body_info.m_referer = value;
-						else if(!string_tools::compare_no_case(key, "Content-Length"))
-							body_info.m_content_length = value;
-						else if(!string_tools::compare_no_case(key, "Content-Type"))
-							body_info.m_content_type = value;
-						else if(!string_tools::compare_no_case(key, "Transfer-Encoding"))
-							body_info.m_transfer_encoding = value;
-						else if(!string_tools::compare_no_case(key, "Content-Encoding"))
-							body_info.m_content_encoding = value;
-						else if(!string_tools::compare_no_case(key, "Host"))
-							body_info.m_host = value;
-						else if(!string_tools::compare_no_case(key, "Cookie"))
-							body_info.m_cookie = value;
-						else if(!string_tools::compare_no_case(key, "User-Agent"))
-							body_info.m_user_agent = value;
-						else if(!string_tools::compare_no_case(key, "Origin"))
-							body_info.m_origin = value;
-						else
-							body_info.m_etc_fields.emplace_back(key, value);
+						case header_name_hash("Connection"): field = &body_info.m_connection; name = "Connection"; break;
+						case header_name_hash("Referrer"): field = &body_info.m_referer; name = "Referrer"; break;
+						case header_name_hash("Content-Length"): field = &body_info.m_content_length; name = "Content-Length"; break;
+						case header_name_hash("Content-Type"): field = &body_info.m_content_type; name = "Content-Type"; break;
+						case header_name_hash("Transfer-Encoding"): field = &body_info.m_transfer_encoding; name = "Transfer-Encoding"; break;
+						case header_name_hash("Content-Encoding"): field = &body_info.m_content_encoding; name = "Content-Encoding"; break;
+						case header_name_hash("Host"): field = &body_info.m_host; name = "Host"; break;
+						case header_name_hash("Cookie"): field = &body_info.m_cookie; name = "Cookie"; break;
+						case header_name_hash("User-Agent"): field = &body_info.m_user_agent; name = "User-Agent"; break;
+						case header_name_hash("Origin"): field = &body_info.m_origin; name = "Origin"; break;
+						default: break;
 					}
+					// the hash only tells the known names apart, anything else could collide
+					if (field && header_name_equals(key, name))
+						field->assign(value.data(), value.size());
+					else
+						body_info.m_etc_fields.emplace_back(std::string(key.data(), key.size()), std::string(value.data(), value.size()));
 				}
 				return true;
 			}
@@ -890,12 +960,15 @@ namespace net_utils
 			inline
 				bool set_reply_content_encoder()
 			{
-				STATIC_REGEXP_EXPR_1(rexp_match_gzip, "^.*?((gzip)|(deflate))", boost::regex::icase | boost::regex::normal);
-				boost::smatch result;						//   12      3
-				if(boost::regex_search( m_response_info.m_header_info.m_content_encoding, result, rexp_match_gzip, boost::match_default) && result[0].matched)
+				// plain string matching for what every response goes through, the
+				// static regexes go away at exit while clients may still be parsing
+				const std::string encoding = boost::algorithm::to_lower_copy(m_response_info.m_header_info.m_content_encoding);
+				const size_t gzip = encoding.find("gzip"), deflate = encoding.find("deflate");
+				if(gzip != std::string::npos || deflate != std::string::npos)
 				{
+					m_identity_encoding = false;
 #ifdef HTTP_ENABLE_GZIP
-					m_pcontent_encoding_handler.reset(new content_encoding_gzip(this, result[3].matched));
+					m_pcontent_encoding_handler.reset(new content_encoding_gzip(this, deflate < gzip));
 #else
           m_pcontent_encoding_handler.reset(new do_nothing_sub_handler(this));
           LOG_ERROR("GZIP encoding not supported in this build, please add zlib to your project and define HTTP_ENABLE_GZIP");
@@ -905,6 +978,7 @@ namespace net_utils
 				else 
 				{
 					m_pcontent_encoding_handler.reset(new do_nothing_sub_handler(this));
+					m_identity_encoding = true;
 				}
 
 				return true;
@@ -945,6 +1019,7 @@ namespace net_utils
 					}
 					m_state = reciev_machine_state_body_chunked;
 					m_chunked_state = http_chunked_state_chunk_head;
+					m_chunked_cache.clear();
 					return true;
 				}
 				else if(!m_response_info.m_header_info.m_content_length.empty())
@@ -986,12 +1061,7 @@ namespace net_utils
 			inline 
 				bool is_connection_close_field(const std::string& str)
 			{
-				STATIC_REGEXP_EXPR_1(rexp_match_close, "^\\s*close", boost::regex::icase | boost::regex::normal);
-				boost::smatch result;
-				if(boost::regex_search( str, result, rexp_match_close, boost::match_default) && result[0].matched)
-					return true;
-				else
-					return false;
+				return boost::algorithm::istarts_with(boost::algorithm::trim_left_copy(str), "close");
 			}
 			inline
 				bool is_multipart_body(const http_header_info& head_info, OUT std::string& boundary)
@@ -26,6 +26,9 @@
 
 #pragma once 
 
+#include <string>
+#include "span.h"
+
 #undef MONERO_DEFAULT_LOG_CATEGORY
 #define MONERO_DEFAULT_LOG_CATEGORY "net.http"
 
@@ -37,12 +40,13 @@ namespace epee
     {
       virtual ~i_sub_handler(){}
 
-      virtual bool update_in( std::string& piece_of_transfer)=0;
+      //! `piece_of_transfer` points into the receive buffer and is only valid during the call
+      virtual bool update_in(span<const char> piece_of_transfer)=0;
       virtual void stop(std::string& collect_remains)=0;
       virtual bool update_and_stop(std::string& collect_remains, bool& is_changed)
       {
         is_changed = true;
-        bool res = this->update_in(collect_remains);
+        bool res = this->update_in(to_span(collect_remains));
         if(res)
           this->stop(collect_remains);
         return res;
@@ -53,7 +57,12 @@ namespace epee
     struct i_target_handler
     {
       virtual ~i_target_handler(){}
-      virtual bool handle_target_data( std::string& piece_of_transfer)=0;
+      //! `piece_of_transfer` is only valid during the call, copy what needs to be kept
+      virtual bool handle_target_data(span<const char> piece_of_transfer)=0;
+      //! Where a body with a Content-Length and no content encoding may be read
+      //! straight into, rather than into the client's buffer and copied from there.
+      //! What was read into it is then passed to handle_target_data in place.
+      virtual span<char> get_target_buffer() { return nullptr; }
     };
 
 
@@ -62,7 +71,7 @@ namespace epee
     public: 
       do_nothing_sub_handler(i_target_handler* powner_filter):m_powner_filter(powner_filter)
       {}
-      virtual bool update_in( std::string& piece_of_transfer)
+      virtual bool update_in(span<const char> piece_of_transfer)
       {
         return m_powner_filter->handle_target_data(piece_of_transfer);
       }
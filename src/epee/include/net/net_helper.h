@@ -104,13 +104,15 @@ namespace net_utils
 		inline
 			blocked_mode_client() :
 				m_io_service(),
-				m_ctx(boost::asio::ssl::context::tlsv12),
-				m_ssl_socket(new boost::asio::ssl::stream<boost::asio::ip::tcp::socket>(m_io_service, m_ctx)),
+				m_ctx(ssl_options_t(ssl_support_t::e_ssl_support_disabled).get_shared_context(ssl_role_t::client)),
+				m_ssl_socket(new boost::asio::ssl::stream<boost::asio::ip::tcp::socket>(m_io_service, *m_ctx)),
 				m_connector(direct_connect{}),
 				m_ssl_options(epee::net_utils::ssl_support_t::e_ssl_support_autodetect),
 				m_initialized(true),
 				m_connected(false),
 				m_deadline(m_io_service, std::chrono::steady_clock::time_point::max()),
+				m_deadline_limit(std::chrono::steady_clock::time_point::max()),
+				m_interrupted(false),
 				m_shutdowned(0),
 				m_bytes_sent(0),
 				m_bytes_received(0)
@@ -144,10 +146,8 @@ namespace net_utils
 
 		inline void set_ssl(ssl_options_t ssl_options)
 		{
-			if (ssl_options)
-				m_ctx = ssl_options.create_context();
-			else
-				m_ctx = boost::asio::ssl::context(boost::asio::ssl::context::tlsv12);
+			// contexts are shared, so the CA store is only loaded once per set of options
+			m_ctx = ssl_options.get_shared_context(ssl_role_t::client);
 			m_ssl_options = std::move(ssl_options);
 		}
 
@@ -160,7 +160,8 @@ namespace net_utils
     inline
 			try_connect_result_t try_connect(const std::string& addr, const std::string& port, std::chrono::milliseconds timeout)
 		{
-				m_deadline.expires_from_now(timeout);
+				if (!arm_deadline(timeout))
+					return CONNECT_FAILURE;
 				boost::unique_future<boost::asio::ip::tcp::socket> connection = m_connector(addr, port, m_deadline);
 				for (;;)
 				{
@@ -169,6 +170,12 @@ namespace net_utils
 
 					if (connection.is_ready())
 						break;
+					// the connector's handlers only hold on to its own state, they can be left behind
+					if (m_interrupted)
+					{
+						MDEBUG("Connecting to " << addr << ":" << port << " interrupted");
+						return CONNECT_FAILURE;
+					}
 				}
 
 				m_ssl_socket->next_layer() = connection.get();
@@ -180,9 +187,9 @@ namespace net_utils
 					// SSL Options
 					if (m_ssl_options.support == epee::net_utils::ssl_support_t::e_ssl_support_enabled || m_ssl_options.support == epee::net_utils::ssl_support_t::e_ssl_support_autodetect)
 					{
-						if (!m_ssl_options.handshake(*m_ssl_socket, boost::asio::ssl::stream_base::client, addr, timeout))
+						if (!m_ssl_options.handshake(*m_ssl_socket, boost::asio::ssl::stream_base::client, addr, get_timeout(timeout)))
 						{
-							if (m_ssl_options.support == epee::net_utils::ssl_support_t::e_ssl_support_autodetect)
+							if (m_ssl_options.support == epee::net_utils::ssl_support_t::e_ssl_support_autodetect && !m_interrupted)
 							{
 								boost::system::error_code ignored_ec;
 								m_ssl_socket->next_layer().shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored_ec);
@@ -211,13 +218,16 @@ namespace net_utils
 			bool connect(const std::string& addr, const std::string& port, std::chrono::milliseconds timeout)
 		{
 			m_connected = false;
+			if (m_interrupted)
+				return false;
+			const auto start = std::chrono::steady_clock::now();
 			try
 			{
 				m_ssl_socket->next_layer().close();
 
 				// Set SSL options
 				// disable sslv2
-				m_ssl_socket.reset(new boost::asio::ssl::stream<boost::asio::ip::tcp::socket>(m_io_service, m_ctx));
+				m_ssl_socket.reset(new boost::asio::ssl::stream<boost::asio::ip::tcp::socket>(m_io_service, *m_ctx));
 
 				// Get a list of endpoints corresponding to the server name.
 
@@ -234,6 +244,8 @@ namespace net_utils
 							return false;
 					}
 				}
+				MDEBUG("Connected to " << addr << ":" << port << (m_ssl_options.support == ssl_support_t::e_ssl_support_disabled ? "" : " with SSL") << " in "
+					<< std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count() << " ms");
 			}
 			catch(const boost::system::system_error& er)
 			{
@@ -287,7 +299,11 @@ namespace net_utils
 
 			try
 			{
-				m_deadline.expires_from_now(timeout);
+				if (!arm_deadline(timeout))
+				{
+					m_connected = false;
+					return false;
+				}
 
 				// Set up the variable that receives the result of the asynchronous
 				// operation. The error code is set to would_block to signal that the
@@ -395,7 +411,7 @@ namespace net_utils
 
 		bool is_connected(bool *ssl = NULL)
 		{
-			if (!m_connected || !m_ssl_socket->next_layer().is_open())
+			if (!m_connected || m_interrupted || !m_ssl_socket->next_layer().is_open())
 				return false;
 			if (ssl)
 				*ssl = m_ssl_options.support != ssl_support_t::e_ssl_support_disabled;
@@ -405,13 +421,35 @@ namespace net_utils
 		inline 
 		bool recv(std::string& buff, std::chrono::milliseconds timeout)
 		{
+			static const size_t max_size = 16384;
+			buff.resize(max_size);
+			size_t received = 0;
+			const bool r = recv(&buff[0], max_size, received, timeout);
+			buff.resize(received);
+			return r;
+		}
 
+		//! Reads at least one byte into `buff`. `received` is 0 if the peer closed the connection.
+		bool recv(char *buff, size_t max_size, size_t &received, std::chrono::milliseconds timeout)
+		{
+			return recv(boost::asio::buffer(buff, max_size), received, timeout);
+		}
+
+		//! As above, filling `buffers` in order with a single read
+		template<typename MutableBufferSequence>
+		bool recv(const MutableBufferSequence &buffers, size_t &received, std::chrono::milliseconds timeout)
+		{
+			received = 0;
 			try
 			{
 				// Set a deadline for the asynchronous operation. Since this function uses
 				// a composed operation (async_read_until), the deadline applies to the
 				// entire operation, rather than individual reads from the socket.
-				m_deadline.expires_from_now(timeout);
+				if (!arm_deadline(timeout))
+				{
+					m_connected = false;
+					return false;
+				}
 
 				// Set up the variable that receives the result of the asynchronous
 				// operation. The error code is set to would_block to signal that the
@@ -430,10 +468,7 @@ namespace net_utils
 			
 				handler_obj hndlr(ec, bytes_transfered);
 
-				static const size_t max_size = 16384;
-				buff.resize(max_size);
-				
-				async_read(&buff[0], max_size, boost::asio::transfer_at_least(1), hndlr);
+				async_read(buffers, transfer_available(*m_ssl_socket, m_ssl_options.support != ssl_support_t::e_ssl_support_disabled), hndlr);
 
 				// Block until the asynchronous operation has completed.
 				while (ec == boost::asio::error::would_block && !boost::interprocess::ipcdetail::atomic_read32(&m_shutdowned))
@@ -450,7 +485,6 @@ namespace net_utils
                     {
                       MTRACE("Connection err_code eof.");
                       //connection closed there, empty
-                      buff.clear();
                       return true;
                     }
 
@@ -467,7 +501,7 @@ namespace net_utils
 					return false;*/
 
 				m_bytes_received += bytes_transfered;
-				buff.resize(bytes_transfered);
+				received = bytes_transfered;
 				return true;
 			}
 
@@ -497,7 +531,11 @@ namespace net_utils
 				// Set a deadline for the asynchronous operation. Since this function uses
 				// a composed operation (async_read_until), the deadline applies to the
 				// entire operation, rather than individual reads from the socket.
-				m_deadline.expires_from_now(timeout);
+				if (!arm_deadline(timeout))
+				{
+					m_connected = false;
+					return false;
+				}
 
 				// Set up the variable that receives the result of the asynchronous
 				// operation. The error code is set to would_block to signal that the
@@ -562,6 +600,27 @@ namespace net_utils
 			return false;
 		}
 		
+		/*! Caps the time every later operation may take: each one fails at
+		    `deadline` if its own timeout does not run out first. */
+		void set_deadline(std::chrono::steady_clock::time_point deadline)
+		{
+			m_deadline_limit = deadline;
+		}
+
+		/*! Fails the operation in progress right away, and every one after it,
+		    leaving the connection unusable. Unlike the other functions, this may
+		    be called from any thread. Resolving a host name is the only step it
+		    can not cut short, as that does not go through asio. */
+		void interrupt()
+		{
+			m_interrupted = true;
+			// the socket is closed by whoever runs the operation, the only thread using it
+			m_io_service.post([this]() {
+				boost::system::error_code ec;
+				m_ssl_socket->next_layer().close(ec);
+			});
+		}
+
 		bool shutdown()
 		{
 			m_deadline.cancel();
@@ -609,6 +668,27 @@ namespace net_utils
 
 	private:
 
+		std::chrono::milliseconds get_timeout(std::chrono::milliseconds timeout) const
+		{
+			const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(m_deadline_limit - std::chrono::steady_clock::now());
+			return std::max(std::min(timeout, left), std::chrono::milliseconds(0));
+		}
+
+		//! false if the operation should not be started at all
+		bool arm_deadline(std::chrono::milliseconds timeout)
+		{
+			if (m_interrupted)
+				return false;
+			timeout = get_timeout(timeout);
+			if (timeout.count() <= 0)
+			{
+				MDEBUG("Deadline passed");
+				return false;
+			}
+			m_deadline.expires_from_now(timeout);
+			return true;
+		}
+
 		void check_deadline()
 		{
 			// Check whether the deadline has passed. We compare the deadline against
@@ -673,14 +753,50 @@ namespace net_utils
 				boost::asio::async_write(m_ssl_socket->next_layer(), boost::asio::buffer(data, sz), boost::lambda::var(ec) = boost::lambda::_1);
 		}
 		
-		void async_read(char* buff, size_t sz, boost::asio::detail::transfer_at_least_t transfer_at_least, handler_obj& hndlr)
+		template<typename CompletionCondition>
+		void async_read(char* buff, size_t sz, CompletionCondition completion_condition, handler_obj& hndlr)
+		{
+			async_read(boost::asio::buffer(buff, sz), completion_condition, hndlr);
+		}
+
+		template<typename MutableBufferSequence, typename CompletionCondition>
+		void async_read(const MutableBufferSequence &buffers, CompletionCondition completion_condition, handler_obj& hndlr)
 		{
 			if(m_ssl_options.support == ssl_support_t::e_ssl_support_disabled)
-				boost::asio::async_read(m_ssl_socket->next_layer(), boost::asio::buffer(buff, sz), transfer_at_least, hndlr);
+				boost::asio::async_read(m_ssl_socket->next_layer(), buffers, completion_condition, hndlr);
 			else
-				boost::asio::async_read(*m_ssl_socket, boost::asio::buffer(buff, sz), transfer_at_least, hndlr);
-			
+				boost::asio::async_read(*m_ssl_socket, buffers, completion_condition, hndlr);
 		}
+
+		/* Completion condition which waits for one byte, then keeps going only
+		   while more has already arrived. A single SSL read stops at the end of
+		   a record, so without this a large buffer would never fill. */
+		struct transfer_available
+		{
+			typedef size_t result_type;
+
+			transfer_available(boost::asio::ssl::stream<boost::asio::ip::tcp::socket> &socket, bool ssl): socket(socket), ssl(ssl) {}
+
+			size_t operator()(const boost::system::error_code &ec, size_t bytes_transferred) const
+			{
+				static const size_t max_read_size = 65536;
+				if (ec)
+					return 0;
+				if (bytes_transferred == 0)
+					return max_read_size;
+				boost::system::error_code available_ec;
+				size_t available = socket.next_layer().available(available_ec);
+				if (available_ec)
+					return 0;
+				SSL* const ssl_handle = ssl ? socket.native_handle() : NULL;
+				if (ssl_handle)
+					available += SSL_pending(ssl_handle);
+				return available ? max_read_size : 0;
+			}
+
+			boost::asio::ssl::stream<boost::asio::ip::tcp::socket> &socket;
+			const bool ssl;
+		};
 		
 		std::string get_address_str() const
 		{
@@ -692,13 +808,15 @@ namespace net_utils
 		}
 	protected:
 		boost::asio::io_service m_io_service;
-		boost::asio::ssl::context m_ctx;
+		std::shared_ptr<boost::asio::ssl::context> m_ctx;
 		std::shared_ptr<boost::asio::ssl::stream<boost::asio::ip::tcp::socket>> m_ssl_socket;
 		std::function<connect_func> m_connector;
 		ssl_options_t m_ssl_options;
 		bool m_initialized;
 		bool m_connected;
 		boost::asio::steady_timer m_deadline;
+		std::chrono::steady_clock::time_point m_deadline_limit;
+		std::atomic<bool> m_interrupted;
 		volatile uint32_t m_shutdowned;
 		std::atomic<uint64_t> m_bytes_sent;
 		std::atomic<uint64_t> m_bytes_received;
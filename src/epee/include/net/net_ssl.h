@@ -30,6 +30,7 @@
 #define _NET_SSL_H
 
 #include <chrono>
+#include <memory>
 #include <stdint.h>
 #include <string>
 #include <vector>
@@ -58,6 +59,13 @@ namespace net_utils
     user_ca           //!< Verify peer via specific (possibly chain) certificate(s) only.
   };
 
+  //! Which end of a connection a context is created for
+  enum class ssl_role_t : uint8_t
+  {
+    client, //!< No certificate unless one is configured in `auth`
+    server  //!< Uses a generated certificate if none is configured in `auth`
+  };
+
   struct ssl_authentication_t
   {
     std::string private_key_path; //!< Private key used for authentication
@@ -81,6 +89,7 @@ namespace net_utils
     ssl_authentication_t auth;
     ssl_support_t support;
     ssl_verification_t verification;
+    bool session_resumption; //!< Clients keep sessions per host:port in memory and try to resume them
 
     //! Verification is set to system ca unless SSL is disabled.
     ssl_options_t(ssl_support_t support)
@@ -88,7 +97,8 @@ namespace net_utils
         ca_path(),
         auth(),
         support(support),
-        verification(support == ssl_support_t::e_ssl_support_disabled ? ssl_verification_t::none : ssl_verification_t::system_ca)
+        verification(support == ssl_support_t::e_ssl_support_disabled ? ssl_verification_t::none : ssl_verification_t::system_ca),
+        session_resumption(false)
     {}
 
     //! Provide user fingerprints and/or ca path. Enables SSL and user_certificate verification
@@ -109,7 +119,15 @@ namespace net_utils
     //! Search against internal fingerprints. Always false if `behavior() != user_certificate_check`.
     bool has_fingerprint(boost::asio::ssl::verify_context &ctx) const;
 
-    boost::asio::ssl::context create_context() const;
+    /*! \note Server contexts without a configured certificate share one
+          generated EC certificate per process. Client contexts do not get
+          one, as the peer never asks for it. */
+    boost::asio::ssl::context create_context(ssl_role_t role = ssl_role_t::server) const;
+
+    /*! \return A context for these options, created once per process and
+          shared by everyone asking for the same options. It must not be
+          modified. */
+    std::shared_ptr<boost::asio::ssl::context> get_shared_context(ssl_role_t role = ssl_role_t::server) const;
 
     /*! \note If `this->support == autodetect && this->verification != none`,
           then the handshake will not fail when peer verification fails. The
@@ -145,6 +163,13 @@ namespace net_utils
 	bool create_rsa_ssl_certificate(EVP_PKEY *&pkey, X509 *&cert);
 
 	std::string get_ssl_info(boost::asio::ssl::stream<boost::asio::ip::tcp::socket> &socket);
+
+	struct ssl_session_stats
+	{
+		uint64_t handshakes; //!< successful client handshakes
+		uint64_t resumed;    //!< how many of those resumed a cached session
+	};
+	ssl_session_stats get_ssl_session_stats();
 }
 }
 
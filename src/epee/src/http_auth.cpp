@@ -351,7 +351,7 @@ namespace
 
       server_parameters best{};
 
-      const std::list<field>& fields = response.m_header_info.m_etc_fields;
+      const http::fields_list& fields = response.m_header_info.m_etc_fields;
       auto current = fields.begin();
       const auto end = fields.end();
       while (true)
@@ -683,7 +683,7 @@ namespace
     }
 
     const boost::string_ref nonce;
-    std::list<std::pair<std::string, std::string>>& fields;
+    http::fields_list& fields;
     const bool is_stale;
   };
 
@@ -719,7 +719,7 @@ namespace epee
         assert(user);
         using field = std::pair<std::string, std::string>;
 
-        const std::list<field>& fields = request.m_header_info.m_etc_fields;
+        const fields_list& fields = request.m_header_info.m_etc_fields;
         const auto auth = boost::find_if(fields, [] (const field& value) {
           return boost::equals(client_auth_field, value.first, ascii_iequal);
         });
@@ -27,9 +27,15 @@
 // THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <memory>
 #include <thread>
 #include <boost/asio/ssl.hpp>
 #include <boost/lambda/lambda.hpp>
+#include <boost/thread/lock_guard.hpp>
+#include <boost/thread/mutex.hpp>
 #include <openssl/ssl.h>
 #include <openssl/pem.h>
 #include "misc_log_ex.h"
@@ -282,12 +288,141 @@ ssl_options_t::ssl_options_t(std::vector<std::vector<std::uint8_t>> fingerprints
     ca_path(std::move(ca_path)),
     auth(),
     support(ssl_support_t::e_ssl_support_enabled),
-    verification(ssl_verification_t::user_certificates)
+    verification(ssl_verification_t::user_certificates),
+    session_resumption(false)
 {
   std::sort(fingerprints_.begin(), fingerprints_.end());
 }
 
-boost::asio::ssl::context ssl_options_t::create_context() const
+// generating a key is slow, so all server contexts share one, made on first use
+static bool get_generated_ssl_certificate(EVP_PKEY *&pkey, X509 *&cert)
+{
+  static boost::mutex mutex;
+  static EVP_PKEY *generated_pkey = NULL;
+  static X509 *generated_cert = NULL;
+
+  boost::lock_guard<boost::mutex> lock(mutex);
+  if (!generated_pkey)
+  {
+    EVP_PKEY *new_pkey;
+    X509 *new_cert;
+    if (!create_ec_ssl_certificate(new_pkey, new_cert, NID_X9_62_prime256v1))
+      return false;
+    generated_pkey = new_pkey;
+    generated_cert = new_cert;
+  }
+  pkey = generated_pkey;
+  cert = generated_cert;
+  return true;
+}
+
+#define MAX_CACHED_SSL_SESSIONS 64
+#define MAX_CACHED_SSL_SESSION_AGE 600 // seconds, servers may allow less
+
+static std::atomic<uint64_t> ssl_client_handshakes(0);
+static std::atomic<uint64_t> ssl_client_resumptions(0);
+
+// client sessions, in memory only, keyed by context and host:port
+class ssl_session_cache
+{
+public:
+  static ssl_session_cache &instance();
+
+  // the SSL object owns a copy of its key, so the new session callback can find
+  // it for as long as the connection lives, and only live connections keep keys
+  static int get_key_index()
+  {
+    static const int index = SSL_get_ex_new_index(0, NULL, NULL, NULL, free_key);
+    return index;
+  }
+
+  static void set_key(SSL *ssl, const std::string &key)
+  {
+    std::unique_ptr<std::string> copy(new std::string(key));
+    delete (std::string*)SSL_get_ex_data(ssl, get_key_index());
+    if (SSL_set_ex_data(ssl, get_key_index(), copy.get()))
+      (void)copy.release();
+    else
+      SSL_set_ex_data(ssl, get_key_index(), NULL);
+  }
+
+  // SSL_set_session takes its own reference, so no need to hand one out
+  bool apply(const std::string &key, SSL *ssl)
+  {
+    boost::lock_guard<boost::mutex> lock(mutex);
+    const auto i = sessions.find(key);
+    if (i == sessions.end())
+      return false;
+    if (i->second.expiry <= std::chrono::steady_clock::now())
+    {
+      SSL_SESSION_free(i->second.session);
+      sessions.erase(i);
+      return false;
+    }
+    return SSL_set_session(ssl, i->second.session) == 1;
+  }
+
+  // takes ownership of session
+  void add(const std::string &key, SSL_SESSION *session)
+  {
+    const long timeout = std::min<long>(SSL_SESSION_get_timeout(session), MAX_CACHED_SSL_SESSION_AGE);
+    const auto expiry = std::chrono::steady_clock::now() + std::chrono::seconds(std::max<long>(timeout, 0));
+
+    boost::lock_guard<boost::mutex> lock(mutex);
+    auto i = sessions.find(key);
+    if (i == sessions.end())
+    {
+      if (sessions.size() >= MAX_CACHED_SSL_SESSIONS)
+      {
+        auto oldest = sessions.begin();
+        for (auto j = sessions.begin(); j != sessions.end(); ++j)
+          if (j->second.expiry < oldest->second.expiry)
+            oldest = j;
+        SSL_SESSION_free(oldest->second.session);
+        sessions.erase(oldest);
+      }
+      i = sessions.insert(std::make_pair(key, entry{NULL, expiry})).first;
+    }
+    else
+      SSL_SESSION_free(i->second.session);
+    i->second.session = session;
+    i->second.expiry = expiry;
+  }
+
+private:
+  struct entry
+  {
+    SSL_SESSION *session;
+    std::chrono::steady_clock::time_point expiry;
+  };
+
+  static void free_key(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp)
+  {
+    delete (std::string*)ptr;
+  }
+
+  boost::mutex mutex;
+  std::map<std::string, entry> sessions;
+};
+
+// at namespace scope, so it outlives the threads which are waited for at exit
+static ssl_session_cache session_cache;
+
+ssl_session_cache &ssl_session_cache::instance()
+{
+  return session_cache;
+}
+
+static int on_new_ssl_session(SSL *ssl, SSL_SESSION *session)
+{
+  const std::string *key = (const std::string*)SSL_get_ex_data(ssl, ssl_session_cache::get_key_index());
+  if (!key)
+    return 0;
+  ssl_session_cache::instance().add(*key, session);
+  return 1; // we keep the reference
+}
+
+boost::asio::ssl::context ssl_options_t::create_context(ssl_role_t role) const
 {
   boost::asio::ssl::context ssl_context{boost::asio::ssl::context::tlsv12};
   if (!bool(*this))
@@ -307,10 +442,19 @@ boost::asio::ssl::context ssl_options_t::create_context() const
   SSL_CTX *ctx = ssl_context.native_handle();
   CHECK_AND_ASSERT_THROW_MES(ctx, "Failed to get SSL context");
   SSL_CTX_clear_options(ctx, SSL_OP_LEGACY_SERVER_CONNECT); // SSL_CTX_SET_OPTIONS(3)
-  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF); // https://stackoverflow.com/questions/22378442
+  if (session_resumption && role == ssl_role_t::client)
+  {
+    // we store sessions ourselves, OpenSSL's internal cache is only looked up by servers
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, on_new_ssl_session);
+  }
+  else
+  {
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF); // https://stackoverflow.com/questions/22378442
 #ifdef SSL_OP_NO_TICKET
-  SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET); // https://stackoverflow.com/questions/22378442
+    SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET); // https://stackoverflow.com/questions/22378442
 #endif
+  }
 #ifdef SSL_OP_NO_RENEGOTIATION
   SSL_CTX_set_options(ctx, SSL_OP_NO_RENEGOTIATION);
 #endif
@@ -353,31 +497,15 @@ boost::asio::ssl::context ssl_options_t::create_context() const
   CHECK_AND_ASSERT_THROW_MES(auth.private_key_path.empty() == auth.certificate_path.empty(), "private key and certificate must be either both given or both empty");
   if (auth.private_key_path.empty())
   {
-    EVP_PKEY *pkey;
-    X509 *cert;
-    bool ok = false;
-
-#ifdef USE_EXTRA_EC_CERT
-    CHECK_AND_ASSERT_THROW_MES(create_ec_ssl_certificate(pkey, cert, NID_secp256k1), "Failed to create certificate");
-    CHECK_AND_ASSERT_THROW_MES(SSL_CTX_use_certificate(ctx, cert), "Failed to use generated certificate");
-    if (!SSL_CTX_use_PrivateKey(ctx, pkey))
-      MERROR("Failed to use generated EC private key for " << NID_secp256k1);
-    else
-      ok = true;
-    X509_free(cert);
-    EVP_PKEY_free(pkey);
-#endif
-
-    CHECK_AND_ASSERT_THROW_MES(create_rsa_ssl_certificate(pkey, cert), "Failed to create certificate");
-    CHECK_AND_ASSERT_THROW_MES(SSL_CTX_use_certificate(ctx, cert), "Failed to use generated certificate");
-    if (!SSL_CTX_use_PrivateKey(ctx, pkey))
-      MERROR("Failed to use generated RSA private key for RSA");
-    else
-      ok = true;
-    X509_free(cert);
-    EVP_PKEY_free(pkey);
-
-    CHECK_AND_ASSERT_THROW_MES(ok, "Failed to use any generated certificate");
+    if (role == ssl_role_t::server)
+    {
+      EVP_PKEY *pkey;
+      X509 *cert;
+      CHECK_AND_ASSERT_THROW_MES(get_generated_ssl_certificate(pkey, cert), "Failed to create certificate");
+      // these take their own references
+      CHECK_AND_ASSERT_THROW_MES(SSL_CTX_use_certificate(ctx, cert), "Failed to use generated certificate");
+      CHECK_AND_ASSERT_THROW_MES(SSL_CTX_use_PrivateKey(ctx, pkey), "Failed to use generated private key");
+    }
   }
   else
     auth.use_ssl_certificate(ssl_context);
@@ -385,6 +513,36 @@ boost::asio::ssl::context ssl_options_t::create_context() const
   return ssl_context;
 }
 
+// at namespace scope, so they outlive the threads which are waited for at exit
+static boost::mutex shared_contexts_mutex;
+static std::map<std::string, std::shared_ptr<boost::asio::ssl::context>> shared_contexts;
+
+std::shared_ptr<boost::asio::ssl::context> ssl_options_t::get_shared_context(ssl_role_t role) const
+{
+  // everything create_context looks at
+  std::string key;
+  key += (char)role;
+  key += (char)bool(*this);
+  key += (char)verification;
+  key += (char)(session_resumption && role == ssl_role_t::client);
+  for (const std::string &s: {ca_path, auth.private_key_path, auth.certificate_path})
+  {
+    key += std::to_string(s.size()) + ":";
+    key += s;
+  }
+  for (const std::vector<std::uint8_t> &fingerprint: fingerprints_)
+  {
+    key += std::to_string(fingerprint.size()) + ":";
+    key.append(fingerprint.begin(), fingerprint.end());
+  }
+
+  boost::lock_guard<boost::mutex> lock(shared_contexts_mutex);
+  std::shared_ptr<boost::asio::ssl::context> &context = shared_contexts[key];
+  if (!context)
+    context = std::make_shared<boost::asio::ssl::context>(create_context(role));
+  return context;
+}
+
 void ssl_authentication_t::use_ssl_certificate(boost::asio::ssl::context &ssl_context) const
 {
   ssl_context.use_private_key_file(private_key_path, boost::asio::ssl::context::pem);
@@ -520,6 +678,23 @@ bool ssl_options_t::handshake(
     });
   }
 
+  SSL* const ssl = socket.native_handle();
+  if (session_resumption && type == boost::asio::ssl::stream_base::client && support != ssl_support_t::e_ssl_support_autodetect && ssl)
+  {
+    /* sessions are only resumed with the context (and so the verification
+       settings) and host they were verified with. Autodetect lets unverified
+       peers through, so those sessions are never stored. */
+    boost::system::error_code endpoint_ec;
+    const auto endpoint = socket.next_layer().remote_endpoint(endpoint_ec);
+    if (!endpoint_ec)
+    {
+      ssl_session_cache &cache = ssl_session_cache::instance();
+      const std::string key = std::to_string((uintptr_t)SSL_get_SSL_CTX(ssl)) + "/" + host + ":" + std::to_string(endpoint.port());
+      ssl_session_cache::set_key(ssl, key);
+      cache.apply(key, ssl);
+    }
+  }
+
   auto& io_service = GET_IO_SERVICE(socket);
   boost::asio::steady_timer deadline(io_service, timeout);
   deadline.async_wait([&socket](const boost::system::error_code& error) {
@@ -537,11 +712,12 @@ bool ssl_options_t::handshake(
   }
   while (ec == boost::asio::error::would_block && !io_service.stopped())
   {
-    // should poll_one(), can't run_one() because it can block if there is
-    // another worker thread executing io_service's tasks
+    // should poll(), can't run_one() because it can block if there is
+    // another worker thread executing io_service's tasks. Everything ready
+    // is run, a handshake (or its failure) can take several handlers.
     // TODO: once we get Boost 1.66+, replace with run_one_for/run_until
     std::this_thread::sleep_for(std::chrono::milliseconds(30));
-    io_service.poll_one();
+    io_service.poll();
   }
 
   if (ec)
@@ -554,10 +730,28 @@ bool ssl_options_t::handshake(
     MERROR("SSL handshake failed, connection dropped");
     return false;
   }
+  if (type == boost::asio::ssl::stream_base::client)
+  {
+    ++ssl_client_handshakes;
+    if (ssl && SSL_session_reused(ssl))
+    {
+      ++ssl_client_resumptions;
+      MDEBUG("SSL handshake success, session resumed");
+      return true;
+    }
+  }
   MDEBUG("SSL handshake success");
   return true;
 }
 
+ssl_session_stats get_ssl_session_stats()
+{
+  ssl_session_stats stats;
+  stats.handshakes = ssl_client_handshakes;
+  stats.resumed = ssl_client_resumptions;
+  return stats;
+}
+
 bool ssl_support_from_string(ssl_support_t &ssl, boost::string_ref s)
 {
   if (s == "enabled")
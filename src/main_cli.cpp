@@ -0,0 +1,327 @@
+/*  monero-update - An downloaded/checker updater for Monero
+ *
+ *  Copyright (c) 2019, The Monero Project
+ *
+ *  All rights reserved.
+ *
+ *  monero-update is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  monero-update is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with monero-update.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <boost/thread.hpp>
+#include "misc_log_ex.h"
+#include "string_tools.h"
+#include "update_engine.h"
+
+// exit codes
+#define EXIT_OK 0              // valid update downloaded, or nothing newer to get
+#define EXIT_VERIFY_FAILED 1   // bad hash or Gitian signatures
+#define EXIT_ERROR 2           // could not complete the check
+#define EXIT_USAGE 3
+
+// how often the download progress is looked at
+#define PROGRESS_INTERVAL 250 // ms
+
+static std::string json_escape(const std::string &s)
+{
+  std::string out;
+  out.reserve(s.size() + 2);
+  for (char c: s)
+  {
+    switch (c)
+    {
+      case '"': out += "\\\""; break;
+      case '\\': out += "\\\\"; break;
+      case '\n': out += "\\n"; break;
+      case '\r': out += "\\r"; break;
+      case '\t': out += "\\t"; break;
+      default:
+        if ((unsigned char)c < 0x20)
+        {
+          char buf[8];
+          snprintf(buf, sizeof(buf), "\\u%04x", (unsigned char)c);
+          out += buf;
+        }
+        else
+          out += c;
+        break;
+    }
+  }
+  return out;
+}
+
+static const char *tristate_name(tristate_t t)
+{
+  switch (t)
+  {
+    case TriTrue: return "true";
+    case TriFalse: return "false";
+    default: return "unknown";
+  }
+}
+
+class cli_listener: public update_listener
+{
+public:
+  cli_listener(bool json): json(json), start_time(std::chrono::steady_clock::now()), done(false), final_state(StateNone), last_percent(-1) {}
+
+  virtual void on_state_changed(State state, const char *name, tristate_t outcome)
+  {
+    if (json)
+      print_json("state", std::string("\"state\":\"") + json_escape(name) + "\",\"outcome\":\"" + tristate_name(outcome) + "\"");
+    else
+      print_text(std::string("State: ") + name);
+    if (outcome != TriUnknown)
+    {
+      boost::unique_lock<boost::mutex> lock(mutex);
+      done = true;
+      final_state = state;
+      cond.notify_all();
+    }
+  }
+  virtual void on_version_changed(const std::string &version)
+  {
+    if (version.empty())
+      return;
+    if (json)
+      print_json("version", "\"version\":\"" + json_escape(version) + "\"");
+    else
+      print_text("Version: " + version);
+  }
+  virtual void on_message(const std::string &s)
+  {
+    if (json)
+      print_json("message", "\"message\":\"" + json_escape(s) + "\"");
+    else
+      print_text(s);
+  }
+  virtual void on_valid_gitian_sigs_changed(uint32_t sigs)
+  {
+    if (json && sigs > 0)
+      print_json("gitian", "\"valid_signatures\":" + std::to_string(sigs));
+  }
+  virtual void on_valid_update_ready(const std::string &filename)
+  {
+    if (json)
+      print_json("update", "\"filename\":\"" + json_escape(filename) + "\"");
+    else
+      print_text("Verified update: " + filename);
+  }
+
+  //! true with the final state once the engine is done, false if it is not by `timeout`
+  bool wait_for(std::chrono::milliseconds timeout, State &state)
+  {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    const boost::chrono::steady_clock::time_point deadline = boost::chrono::steady_clock::now() + boost::chrono::milliseconds(timeout.count());
+    while (!done)
+      if (cond.wait_until(lock, deadline) == boost::cv_status::timeout)
+        return false;
+    state = final_state;
+    return true;
+  }
+
+  void report_download_progress(const download_progress_t &progress)
+  {
+    // only report whole percent steps
+    const int percent = progress.total > 0 ? (int)(progress.downloaded * 100 / progress.total) : -1;
+    if (percent == last_percent)
+      return;
+    last_percent = percent;
+    if (json)
+      print_json("progress", "\"downloaded\":" + std::to_string(progress.downloaded) + ",\"total\":" + std::to_string(progress.total) +
+          ",\"rate\":" + std::to_string(progress.rate) + ",\"eta\":" + std::to_string(progress.eta));
+    else if (percent >= 0)
+      print_text("Downloaded " + std::to_string(progress.downloaded) + "/" + std::to_string(progress.total) + " bytes (" + std::to_string(percent) + "%), " +
+          std::to_string(progress.rate / 1024) + " kB/s" + (progress.eta >= 0 ? ", " + std::to_string(progress.eta) + " s left" : ""));
+  }
+
+private:
+  uint64_t elapsed_ms() const
+  {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start_time).count();
+  }
+  void print_text(const std::string &s)
+  {
+    boost::unique_lock<boost::mutex> lock(output_mutex);
+    printf("[%8.3f] %s\n", elapsed_ms() / 1000.0f, s.c_str());
+    fflush(stdout);
+  }
+  void print_json(const char *event, const std::string &fields)
+  {
+    boost::unique_lock<boost::mutex> lock(output_mutex);
+    printf("{\"t_ms\":%llu,\"event\":\"%s\",%s}\n", (unsigned long long)elapsed_ms(), event, fields.c_str());
+    fflush(stdout);
+  }
+
+  const bool json;
+  const std::chrono::steady_clock::time_point start_time;
+  boost::mutex mutex;
+  boost::mutex output_mutex;
+  boost::condition_variable cond;
+  bool done;
+  State final_state;
+  int last_percent; // only used by the main thread
+};
+
+static int get_exit_code(State state)
+{
+  switch (state)
+  {
+    case StateValidUpdate:
+    case StateUpToDate:
+    case StateBackInTime:
+      return EXIT_OK;
+    case StateBadHash:
+    case StateBadGitianSigs:
+    case StateNotEnoughGitianSigs:
+    case StateNoGitianSigs:
+      return EXIT_VERIFY_FAILED;
+    default:
+      return EXIT_ERROR;
+  }
+}
+
+static std::string get_default_cache_dir(const char *name)
+{
+#ifdef _WIN32
+  const char *base = getenv("LOCALAPPDATA");
+  if (!base || !*base)
+    return "";
+  return std::string(base) + "\\monero-update\\" + name;
+#else
+  const char *base = getenv("XDG_CACHE_HOME");
+  if (base && *base)
+    return std::string(base) + "/monero-update/" + name;
+  base = getenv("HOME");
+  if (!base || !*base)
+    return "";
+  return std::string(base) + "/.cache/monero-update/" + name;
+#endif
+}
+
+static void usage(const char *argv0)
+{
+  fprintf(stderr, "usage: %s [options]\n", argv0);
+  fprintf(stderr, "  --json                           print one JSON object per event\n");
+  fprintf(stderr, "  --gitian-fetch-concurrency <n>   number of Gitian signers to fetch at once\n");
+  fprintf(stderr, "  --keyring-cache-dir <dir>        where to keep the imported keyring\n");
+  fprintf(stderr, "  --no-keyring-cache               use a throwaway keyring\n");
+  fprintf(stderr, "  --mirror <url>                   also try downloading from this mirror, may be repeated\n");
+  fprintf(stderr, "  --limit-rate <bytes/s>           download the update no faster than this\n");
+  fprintf(stderr, "  --limit-total-rate <bytes/s>     download no faster than this, all downloads together\n");
+  fprintf(stderr, "  --download-timeout <s>           give up on the update download after this long, 0 (default) for never\n");
+  fprintf(stderr, "  --idle-only                      slow the update download down while other traffic is seen\n");
+  fprintf(stderr, "exit codes: %d valid update or up to date, %d verification failed, %d other error\n", EXIT_OK, EXIT_VERIFY_FAILED, EXIT_ERROR);
+}
+
+int main(int argc, char **argv)
+{
+  bool json = false;
+  unsigned int concurrency = 0;
+  std::string keyring_cache_dir = get_default_cache_dir("keyrings");
+  std::vector<std::string> mirrors;
+  uint64_t rate_limit = 0;
+  uint64_t total_rate_limit = 0;
+  unsigned int download_timeout = 0;
+  bool download_timeout_set = false;
+  bool idle_only = false;
+
+  for (int i = 1; i < argc; ++i)
+  {
+    const std::string arg = argv[i];
+    if (arg == "--json")
+      json = true;
+    else if (arg == "--gitian-fetch-concurrency" && i + 1 < argc)
+    {
+      if (!epee::string_tools::get_xtype_from_string(concurrency, argv[++i]) || concurrency == 0)
+      {
+        usage(argv[0]);
+        return EXIT_USAGE;
+      }
+    }
+    else if (arg == "--keyring-cache-dir" && i + 1 < argc)
+      keyring_cache_dir = argv[++i];
+    else if (arg == "--no-keyring-cache")
+      keyring_cache_dir.clear();
+    else if (arg == "--mirror" && i + 1 < argc)
+      mirrors.push_back(argv[++i]);
+    else if (arg == "--limit-rate" && i + 1 < argc)
+    {
+      if (!epee::string_tools::get_xtype_from_string(rate_limit, argv[++i]))
+      {
+        usage(argv[0]);
+        return EXIT_USAGE;
+      }
+    }
+    else if (arg == "--limit-total-rate" && i + 1 < argc)
+    {
+      if (!epee::string_tools::get_xtype_from_string(total_rate_limit, argv[++i]))
+      {
+        usage(argv[0]);
+        return EXIT_USAGE;
+      }
+    }
+    else if (arg == "--download-timeout" && i + 1 < argc)
+    {
+      if (!epee::string_tools::get_xtype_from_string(download_timeout, argv[++i]))
+      {
+        usage(argv[0]);
+        return EXIT_USAGE;
+      }
+      download_timeout_set = true;
+    }
+    else if (arg == "--idle-only")
+      idle_only = true;
+    else
+    {
+      usage(argv[0]);
+      return arg == "--help" || arg == "-h" ? EXIT_OK : EXIT_USAGE;
+    }
+  }
+
+  if (getenv("MONERO_LOGS"))
+  {
+    epee::string_tools::set_module_name_and_folder(argv[0]);
+    mlog_configure(mlog_get_default_log_path("monero-update.log"), false);
+  }
+
+  tools::set_download_rate_limit(total_rate_limit);
+
+  cli_listener listener(json);
+  State state;
+  {
+    update_engine engine(listener);
+    if (concurrency)
+      engine.set_gitian_fetch_concurrency(concurrency);
+    engine.set_keyring_cache_dir(keyring_cache_dir);
+    engine.set_mirrors(mirrors);
+    engine.set_download_dir(get_default_cache_dir("downloads"));
+    engine.set_download_idle_only(idle_only);
+    engine.set_download_rate_limit(rate_limit);
+    if (download_timeout_set)
+      engine.set_download_timeout(download_timeout);
+    engine.start();
+    // the engine keeps counters as the update downloads, which are looked at from here
+    download_progress_t progress;
+    while (!listener.wait_for(std::chrono::milliseconds(PROGRESS_INTERVAL), state))
+      if (engine.get_download_progress(progress))
+        listener.report_download_progress(progress);
+  }
+  return get_exit_code(state);
+}
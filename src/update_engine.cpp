@@ -0,0 +1,1631 @@
+/*  monero-update - An downloaded/checker updater for Monero
+ *
+ *  Copyright (c) 2019, The Monero Project
+ *
+ *  All rights reserved.
+ *
+ *  monero-update is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  monero-update is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with monero-update.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <fstream>
+#include <random>
+#include <boost/algorithm/string.hpp>
+#include <boost/filesystem.hpp>
+#include <gpgme.h>
+#include "misc_log_ex.h"
+#include "reg_exp_definer.h"
+#include "common/threadpool.h"
+#include "common/dns_utils.h"
+#include "common/vercmp.h"
+#include "common/updates.h"
+#include "common/download.h"
+#include "common/sha256sum.h"
+#include "pubkeys.h"
+#include "update_engine.h"
+
+#define MIN_GITIAN_SIGS 2
+
+// start downloading as soon as we know what to download, and verify the
+// Gitian signatures while it is in flight
+#define PIPELINED_DOWNLOAD true
+
+// how many connections to download the update over, if the server allows ranges
+#define DOWNLOAD_SEGMENTS 4
+
+// how long downloading the update may take, 0 for no limit. None by default: an idle
+// only or rate limited download can rightly take hours, and a stalled connection is
+// already caught by the per operation timeouts. A partial download is kept, and
+// carried on from by a retry
+#define DOWNLOAD_TIMEOUT 0 // seconds
+
+// how many Gitian signers to fetch at the same time
+#define GITIAN_FETCH_CONCURRENCY 8
+
+// resume TLS sessions, the Gitian fetch makes a lot of connections to the same host
+#define TLS_SESSION_RESUMPTION true
+
+// how long fetching all the Gitian signatures may take, on top of each request's own timeouts
+#define GITIAN_FETCH_TIMEOUT 120 // seconds
+
+// upper bounds for what we are willing to download into memory
+#define MAX_GITIAN_TREE_SIZE (16 * 1024 * 1024)
+#define MAX_GITIAN_FILE_SIZE (1024 * 1024)
+
+// how long the download rate is averaged over, and the least time between samples
+#define DOWNLOAD_RATE_SMOOTHING 3.0 // seconds
+#define DOWNLOAD_RATE_MIN_SAMPLE 0.1 // seconds
+
+// list of imported fingerprints and signer names in a cached keyring
+#define KEYRING_MANIFEST "fingerprints"
+
+void set_strict_default_file_permissions(bool strict)
+{
+#if defined(__MINGW32__) || defined(__MINGW__)
+  // no clue about the odd one out
+#else
+  mode_t mode = strict ? 077 : 0;
+  umask(mode);
+#endif
+}
+
+static bool create_private_directory(const boost::filesystem::path &path)
+{
+  boost::system::error_code ec;
+  set_strict_default_file_permissions(true);
+  boost::filesystem::create_directories(path, ec);
+  set_strict_default_file_permissions(false);
+  if (ec)
+  {
+    MERROR("Failed to create " << path << ": " << ec.message());
+    return false;
+  }
+  return true;
+}
+
+// only we can have written anything in there, so it can be trusted as much as we are
+static bool is_private_directory(const boost::filesystem::path &path)
+{
+#if defined(__MINGW32__) || defined(__MINGW__)
+  return true;
+#else
+  struct stat st;
+  if (lstat(path.string().c_str(), &st))
+    return false;
+  return S_ISDIR(st.st_mode) && st.st_uid == geteuid() && (st.st_mode & 0777) == 0700;
+#endif
+}
+
+static std::string detect_build_tag(void)
+{
+  std::string cpuinfo;
+
+#if defined _WIN64
+  return "win-x64";
+#endif
+
+#if defined _WIN32
+  return "win-x86";
+#endif
+
+#if defined __FreeBSD__ || defined __FreeBSD_kernel__
+  return "freebsd";
+#endif
+
+#if defined __APPLE__
+  return "mac-x64";
+#endif
+
+#if defined __linux__ && defined __aarch64__
+    return "linux-armv8";
+#endif
+
+#if defined __linux__ && defined __arm__
+  return "linux-armv7";
+#endif
+
+#if defined __linux__ && defined __i386__
+  return "linux-x86";
+#endif
+
+#if defined __linux__ && defined __x86_64__
+  return "linux-x64";
+#endif
+
+  return "source";
+}
+
+static const std::map<std::string, std::string> dnssec_to_gitian = {
+  std::make_pair("linux-x64", "x86_64-linux-gnu"),
+  std::make_pair("linux-x32", "i686-linux-gnu"),
+  std::make_pair("win-x64", "x86_64-w64-mingw32"),
+  std::make_pair("win-x32", "i686-w64-mingw32"),
+  std::make_pair("freebsd", "x86_64-unknown-freebsd"),
+  std::make_pair("mac-x64", "x86_64-apple-darwin11"),
+  std::make_pair("linux-armv7", "arm-linux-gnueabihf"),
+  std::make_pair("linux-armv8", "aarch64-linux-gnu"),
+};
+
+static const std::map<std::string, std::string> platform_to_gitian = {
+  std::make_pair("mac", "osx"),
+};
+
+#ifndef BUILDTAG
+#define BUILDTAG "source"
+#define SUBDIR "source"
+#else
+#define SUBDIR "cli"
+#endif
+
+#define SOFTWARE "monero"
+
+static std::map<State, std::pair<tristate_t, const char*>> states = {
+  std::make_pair(StateNone, std::make_pair(TriUnknown, "None")),
+  std::make_pair(StateInit, std::make_pair(TriUnknown, "Initializing")),
+  std::make_pair(StateQueryDNS, std::make_pair(TriUnknown, "Querying DNS")),
+  std::make_pair(StateDNSFailed, std::make_pair(TriFalse, "DNS check failed")),
+  std::make_pair(StateCheckVersion, std::make_pair(TriUnknown, "Checking version")),
+  std::make_pair(StateUpToDate, std::make_pair(TriTrue, "We are up to date")),
+  std::make_pair(StateBackInTime, std::make_pair(TriTrue, "Only old versions found")),
+  std::make_pair(StateNoUpdateInfoFound, std::make_pair(TriFalse, "No update information found")),
+  std::make_pair(StateDownload, std::make_pair(TriUnknown, "Downloading update")),
+  std::make_pair(StateDownloadFailed, std::make_pair(TriFalse, "Download failed")),
+  std::make_pair(StateCheckHash, std::make_pair(TriUnknown, "Checking hash")),
+  std::make_pair(StateBadHash, std::make_pair(TriFalse, "Invalid hash")),
+  std::make_pair(StateImportPubkeys, std::make_pair(TriUnknown, "Importing public keys")),
+  std::make_pair(StatePubkeyImportFailed, std::make_pair(TriFalse, "Failed to import public keys")),
+  std::make_pair(StateFetchGitianSigs, std::make_pair(TriUnknown, "Fetching Gitian signatures")),
+  std::make_pair(StateVerifyGitianSignatures, std::make_pair(TriUnknown, "Verifying Gitian signatures")),
+  std::make_pair(StateNoGitianSigs, std::make_pair(TriFalse, "No Gitian signatures found")),
+  std::make_pair(StateNotEnoughGitianSigs, std::make_pair(TriFalse, "Not enough matching Gitian signatures found")),
+  std::make_pair(StateBadGitianSigs, std::make_pair(TriFalse, "At least one Gitian signature was invalid")),
+  std::make_pair(StateValidUpdate, std::make_pair(TriTrue, "Valid update downloaded and verified")),
+};
+
+// All four MoneroPulse domains have DNSSEC on and valid
+static const std::vector<std::string> dns_urls = {
+    "updates.moneropulse.org",
+    "updates.moneropulse.net",
+    "updates.moneropulse.co",
+    "updates.moneropulse.se"
+};
+
+static std::string hash_to_hex(const uint8_t hash[32])
+{
+  std::string hex;
+  hex.resize(64);
+  static const char digits[] = "0123456789abcdef";
+  for (int i = 0; i < 32; ++i)
+  {
+    hex[i * 2] = digits[hash[i] >> 4];
+    hex[i * 2 + 1] = digits[hash[i] & 0xf];
+  }
+  return hex;
+}
+
+static tristate_t get_outcome(State state)
+{
+  return states[state].first;
+}
+
+
+update_engine::update_engine(update_listener &listener):
+  listener(listener),
+  running(false),
+  state(StateNone),
+  event_pending(false),
+  start_time(std::chrono::steady_clock::now()),
+  last_transition_time(start_time),
+  dns_valid(TriUnknown),
+  hash_valid(TriUnknown),
+  valid_gitian_sigs(0),
+  min_valid_gitian_sigs(0),
+  total_gitian_sigs(0),
+  processed_gitian_sigs(0),
+
+  software(SOFTWARE),
+  buildtag(detect_build_tag()),
+  current_version(""),
+
+  pipelined_download(PIPELINED_DOWNLOAD),
+  gitian_fetch_concurrency(GITIAN_FETCH_CONCURRENCY),
+
+  dns_query_done(false),
+  version_check_done(false),
+  download_started(false),
+  download_done(false),
+  download_success(false),
+  gitian_pubkeys_import_done(false),
+  gitian_pubkeys_import_success(false),
+  gitian_verify_sigs_done(false),
+  gitian_verify_sigs_success(false),
+
+  download_resumable(false),
+  download_idle_only(false),
+  download_rate_limit(0),
+  download_timeout(DOWNLOAD_TIMEOUT),
+  progress_received(0),
+  download_rate(0),
+  gpg_home_persistent(false),
+  ctx(NULL)
+{
+  tools::set_download_session_resumption(TLS_SESSION_RESUMPTION);
+}
+
+void update_engine::start()
+{
+  {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (running)
+      return;
+    running = true;
+  }
+  thread = boost::thread([this]() { updater_thread(); } );
+  set_state(StateInit);
+}
+
+update_engine::~update_engine()
+{
+  std::set<tools::download_async_handle> downloads;
+  {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    running = false;
+    cond.notify_one();
+    downloads = buffer_downloads;
+  }
+  // the thread may be waiting on these, they are interrupted rather than waited out
+  for (const tools::download_async_handle &handle: downloads)
+    tools::download_cancel(handle);
+  if (thread.joinable())
+    thread.join();
+  // a partial download is kept, to carry on from next time
+  abort_download(true);
+  release_gpgme_contexts();
+}
+
+void update_engine::set_gitian_fetch_concurrency(unsigned int concurrency)
+{
+  boost::unique_lock<boost::mutex> lock(mutex);
+  gitian_fetch_concurrency = concurrency;
+}
+
+void update_engine::set_keyring_cache_dir(const std::string &dir)
+{
+  boost::unique_lock<boost::mutex> lock(mutex);
+  keyring_cache_dir = dir;
+}
+
+void update_engine::set_mirrors(const std::vector<std::string> &m)
+{
+  boost::unique_lock<boost::mutex> lock(mutex);
+  mirrors = m;
+}
+
+void update_engine::set_download_dir(const std::string &dir)
+{
+  boost::unique_lock<boost::mutex> lock(mutex);
+  download_dir = dir;
+}
+
+void update_engine::set_download_idle_only(bool idle_only)
+{
+  boost::unique_lock<boost::mutex> lock(mutex);
+  download_idle_only = idle_only;
+}
+
+void update_engine::set_download_rate_limit(uint64_t bytes_per_second)
+{
+  boost::unique_lock<boost::mutex> lock(mutex);
+  download_rate_limit = bytes_per_second;
+}
+
+void update_engine::set_download_timeout(unsigned int seconds)
+{
+  boost::unique_lock<boost::mutex> lock(mutex);
+  download_timeout = seconds;
+}
+
+void update_engine::set_dns_valid(tristate_t t)
+{
+  dns_valid = t;
+  listener.on_dns_valid_changed(dns_valid);
+}
+
+void update_engine::set_hash_valid(tristate_t t)
+{
+  hash_valid = t;
+  listener.on_hash_valid_changed(hash_valid);
+}
+
+void update_engine::set_valid_gitian_sigs(uint32_t sigs)
+{
+  valid_gitian_sigs = sigs;
+  listener.on_valid_gitian_sigs_changed(valid_gitian_sigs);
+}
+
+void update_engine::set_min_valid_gitian_sigs(uint32_t sigs)
+{
+  min_valid_gitian_sigs = sigs;
+  listener.on_min_valid_gitian_sigs_changed(min_valid_gitian_sigs);
+}
+
+void update_engine::set_processed_gitian_sigs(uint32_t sigs)
+{
+  processed_gitian_sigs = sigs;
+  listener.on_processed_gitian_sigs_changed(processed_gitian_sigs);
+}
+
+void update_engine::set_total_gitian_sigs(uint32_t sigs)
+{
+  total_gitian_sigs = sigs;
+  listener.on_total_gitian_sigs_changed(total_gitian_sigs);
+}
+
+void update_engine::load_txt_records_from_dns(const std::vector<std::string> &dns_urls, std::vector<dns_query_result_t> &results, std::vector<std::string> &good_records)
+{
+  boost::unique_lock<boost::mutex> lock(mutex);
+
+  dns_query_done = false;
+  set_dns_valid(TriUnknown);
+  results.resize(dns_urls.size());
+  good_records.clear();
+
+  size_t first_index = (std::default_random_engine(time(NULL) ^ getpid())()) % dns_urls.size();
+
+  add_message("Lookup up DNS TXT records for: " + boost::join(dns_urls, ", "));
+
+  // send all requests in parallel
+  tools::threadpool& tpool = tools::threadpool::getInstance();
+  tools::threadpool::waiter waiter;
+  for (size_t n = 0; n < dns_urls.size(); ++n)
+  {
+    tpool.submit(&waiter,[n, dns_urls, &results](){
+      results[n].records = tools::DNSResolver::instance().get_txt_record(dns_urls[n], results[n].avail, results[n].valid); 
+    });
+  }
+  lock.unlock();
+  waiter.wait(&tpool);
+  lock.lock();
+
+  size_t cur_index = first_index;
+  do
+  {
+    const std::string &url = dns_urls[cur_index];
+    if (!results[cur_index].avail)
+    {
+      add_message("DNSSEC not available for hostname: " + url + ", skipping.");
+    }
+    else if (!results[cur_index].valid)
+    {
+      add_message("DNSSEC validation failed for hostname: " + url + ", skipping.");
+    }
+    else if (results[cur_index].records.empty())
+    {
+      add_message("No records for hostname: " + url + ", skipping.");
+    }
+
+    cur_index++;
+    if (cur_index == dns_urls.size())
+    {
+      cur_index = 0;
+    }
+  } while (cur_index != first_index);
+
+  size_t num_valid_records = 0;
+
+  for( const auto& record_set : results)
+  {
+    if (record_set.avail && record_set.valid && record_set.records.size() != 0)
+    {
+      num_valid_records++;
+    }
+  }
+
+  if (num_valid_records < 2)
+  {
+    add_message("WARNING: no two valid DNS TXT records were received");
+    set_dns_valid(TriFalse);
+    dns_query_done = true;
+    return;
+  }
+
+  int good_records_index = -1;
+  for (size_t i = 0; i < results.size() - 1; ++i)
+  {
+    if (!results[i].avail || !results[i].valid || results[i].records.size() == 0) continue;
+
+    for (size_t j = i + 1; j < results.size(); ++j)
+    {
+      if (tools::dns_utils::dns_records_match(results[i].records, results[j].records))
+      {
+        good_records_index = i;
+        break;
+      }
+    }
+    if (good_records_index >= 0) break;
+  }
+
+  if (good_records_index < 0)
+  {
+    add_message("WARNING: no two DNS TXT records matched");
+    set_dns_valid(TriFalse);
+    dns_query_done = true;
+    return;
+  }
+
+  add_message("Found " + std::to_string(num_valid_records) + "/" + std::to_string(dns_urls.size()) + " matching DNSSEC records");
+  good_records = results[good_records_index].records;
+  set_dns_valid(TriTrue);
+  dns_query_done = true;
+}
+
+void update_engine::process_version(const std::string &software, const std::string &buildtag, const std::vector<std::string> &records)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+
+    version_check_done = false;
+    version = "";
+    listener.on_version_changed("");
+
+    bool found = false;
+
+    std::string hash;
+    for (const auto& record : records)
+    {
+      std::vector<std::string> fields;
+      add_message("Got record: " + record);
+      boost::split(fields, record, boost::is_any_of(":"));
+      if (fields.size() != 4)
+      {
+        add_message("Updates record does not have 4 fields: " + record);
+        continue;
+      }
+
+      if (software != fields[0] || buildtag != fields[1])
+        continue;
+
+      // the hash ends up in a file name, so it has to be nothing but hex
+      bool hex = fields[3].size() == 64;
+      for (auto c: fields[3])
+        if (!isxdigit((unsigned char)c))
+          hex = false;
+      if (!hex)
+      {
+        add_message("Invalid hash: " + fields[3]);
+        continue;
+      }
+      boost::algorithm::to_lower(fields[3]);
+
+      // use highest version
+      if (found)
+      {
+        int cmp = tools::vercmp(version.c_str(), fields[2].c_str());
+        if (cmp > 0)
+          continue;
+        if (cmp == 0 && hash != fields[3])
+        {
+          add_message("Two matches found for " + software + " version " + version + " on " + buildtag);
+          version = "";
+          version_check_done = true;
+          return;
+        }
+      }
+      version = fields[2];
+      hash = fields[3];
+
+      add_message("Found new version " + version + " with hash " + hash);
+      found = true;
+    }
+
+    if (!version.empty())
+    {
+      expected_hash = hash;
+      listener.on_version_changed(version);
+    }
+    version_check_done = true;
+}
+
+void update_engine::start_download()
+{
+  boost::unique_lock<boost::mutex> lock(mutex);
+
+  const std::string subdir = strstr(buildtag.c_str(), "-source") ? "source" : strstr(software.c_str(), "-gui") ? "" : "cli";
+  const std::string url = tools::get_update_url(software, subdir, buildtag, version, false);
+  const std::string filename = boost::filesystem::path(url).filename().string();
+  // a name which only depends on what is downloaded lets a later run find a partial download
+  download_resumable = !download_dir.empty() && create_private_directory(download_dir);
+  if (download_resumable)
+    download_path = download_dir / (expected_hash.substr(0, 16) + "-" + filename);
+  else
+    download_path = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("%%%%-%%%%-%%%%-%%%%-" + filename);
+  // the file stays quarantined under another name until it has been verified
+  quarantine_path = download_path.string() + ".unverified";
+  if (download_resumable)
+  {
+    // partial downloads of anything else will not be finished
+    const std::string name = quarantine_path.filename().string();
+    boost::system::error_code ec;
+    for (boost::filesystem::directory_iterator i(download_dir, ec), end; !ec && i != end; i.increment(ec))
+    {
+      const std::string other = i->path().filename().string();
+      if (other.compare(0, name.size(), name) && other.find(".unverified") != std::string::npos)
+      {
+        MINFO("Removing stale partial download " << i->path());
+        boost::filesystem::remove(i->path(), ec);
+      }
+    }
+  }
+  download_started = true;
+  download_done = false;
+  download_success = false;
+  downloaded_hash.clear();
+
+  add_message("Downloading " + url + " to " + quarantine_path.string());
+
+  // the file is hashed as it comes in, so checking it later is just a comparison
+  const std::shared_ptr<tools::sha256_hasher> hasher = std::make_shared<tools::sha256_hasher>();
+  tools::download_options options;
+  options.hasher = hasher;
+  options.segments = DOWNLOAD_SEGMENTS;
+  options.manifest = download_resumable;
+  options.idle_only = download_idle_only;
+  options.max_rate = download_rate_limit;
+  if (download_timeout > 0)
+    options.deadline = std::chrono::steady_clock::now() + std::chrono::seconds(download_timeout);
+  // any mirror will do, the hash from DNS pins the contents
+  for (const std::string &mirror: mirrors)
+    options.mirrors.push_back(tools::get_mirror_update_url(software, subdir, buildtag, version, mirror));
+
+  auto on_result = [this, hasher](const std::string &path, const std::string &url, bool success)
+  {
+    {
+      boost::unique_lock<boost::mutex> lock(mutex);
+      add_message(std::string("Download finished: ") + (success ? "success" : "failed"));
+      uint8_t hash[32];
+      if (success && hasher->finalize(hash))
+        downloaded_hash = hash_to_hex(hash);
+      download_done = true;
+      download_success = success;
+      download_handle = NULL;
+    }
+    listener.on_download_finished(success);
+    wake_up();
+  };
+
+  // progress is polled through get_download_progress rather than called back for every read
+  download_handle = progress_handle = tools::download_async(quarantine_path.string(), url, on_result, NULL, options);
+  progress_time = std::chrono::steady_clock::now();
+  progress_received = 0;
+  download_rate = 0;
+  listener.on_download_started();
+}
+
+void update_engine::abort_download(bool keep_partial)
+{
+  tools::download_async_handle handle;
+  boost::filesystem::path path;
+  {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (!download_started)
+      return;
+    handle = download_handle;
+    path = quarantine_path;
+    keep_partial = keep_partial && download_resumable;
+  }
+
+  // the result callback needs the lock, so we must not hold it here
+  if (handle)
+    tools::download_cancel(handle);
+
+  boost::unique_lock<boost::mutex> lock(mutex);
+  if (!keep_partial)
+    tools::remove_partial_download(path.string());
+  download_started = false;
+}
+
+void update_engine::retry_download()
+{
+  if (state == StateDownloadFailed)
+  {
+    {
+      boost::unique_lock<boost::mutex> lock(mutex);
+      download_started = false;
+    }
+    set_state(StateDownload);
+  }
+}
+
+bool update_engine::get_download_progress(download_progress_t &progress)
+{
+  boost::unique_lock<boost::mutex> lock(mutex);
+  if (!progress_handle)
+    return false;
+  const tools::download_progress p = tools::get_download_progress(progress_handle);
+  const auto now = std::chrono::steady_clock::now();
+  const double seconds = std::chrono::duration<double>(now - progress_time).count();
+  if (seconds >= DOWNLOAD_RATE_MIN_SAMPLE)
+  {
+    // what was on disk already when resuming does not count towards the rate
+    const double rate = (p.received - progress_received) / seconds;
+    // blended in by how much time the sample covers, or taken as is when starting or after a long stall
+    download_rate = download_rate == 0 ? rate : download_rate + (rate - download_rate) * std::min(seconds / DOWNLOAD_RATE_SMOOTHING, 1.0);
+    progress_time = now;
+    progress_received = p.received;
+  }
+  progress.downloaded = p.downloaded;
+  progress.total = p.total;
+  progress.rate = download_rate;
+  if (p.total > 0 && p.downloaded >= p.total)
+    progress.eta = 0;
+  else if (p.total > 0 && progress.rate > 0)
+    progress.eta = (p.total - p.downloaded) / progress.rate;
+  else
+    progress.eta = -1;
+  return true;
+}
+
+void update_engine::check_hash()
+{
+  boost::unique_lock<boost::mutex> lock(mutex);
+  set_hash_valid(TriUnknown);
+
+  if (downloaded_hash.empty())
+  {
+    add_message("Error calculating file hash");
+    set_hash_valid(TriFalse);
+    return;
+  }
+  const std::string file_hash_as_text = downloaded_hash;
+  if (file_hash_as_text != expected_hash)
+  {
+    add_message("Invalid file hash");
+    // or the next run would carry on from it
+    tools::remove_partial_download(quarantine_path.string());
+    set_hash_valid(TriFalse);
+    return;
+  }
+  boost::system::error_code ec;
+  boost::filesystem::rename(quarantine_path, download_path, ec);
+  if (ec)
+  {
+    add_message("Failed to release verified file: " + ec.message());
+    set_hash_valid(TriFalse);
+    return;
+  }
+  add_message("Update verified, hash " + file_hash_as_text);
+  listener.on_valid_update_ready(download_path.string());
+  set_hash_valid(TriTrue);
+}
+
+#ifdef _WIN32
+static std::string find_gpg_directory()
+{
+  const char *path = getenv("PATH");
+  if (!path)
+  {
+    MDEBUG("Empty PATH");
+    return "";
+  }
+
+  MDEBUG("PATH: " << path);
+
+  std::vector<std::string> directories;
+  boost::split(directories, path, boost::is_any_of(";"));
+  for (const std::string &directory: directories)
+  {
+    MDEBUG("Looking in " << directory);
+    boost::system::error_code ec;
+    if (boost::filesystem::is_regular_file(boost::filesystem::path(directory) / "gpg.exe", ec))
+    {
+      MINFO("gpg binary found in " << directory);
+      return directory;
+    }
+  }
+  MINFO("gpg binary not found");
+  return "";
+}
+#endif
+
+bool update_engine::init_gpgme()
+{
+  // global setup only needs doing once per process
+  static bool gpgme_initialized = false;
+  gpg_error_t err;
+
+  if (!gpgme_initialized)
+  {
+#ifdef _WIN32
+    std::string gpgdir = find_gpg_directory();
+    if (!gpgdir.empty())
+      gpgme_set_global_flag("w32-inst-dir", gpgdir.c_str());
+    gpgme_set_global_flag("disable-gpgconf", "1");
+    gpgme_set_global_flag("gpg-name", "gpg");
+#endif
+    gpgme_check_version(NULL);
+    err = gpgme_engine_check_version(GPGME_PROTOCOL_OpenPGP);
+    if (err)
+    {
+      printf("Failed to initialize gpgme: %s\n", gpg_strerror(err));
+      return false;
+    }
+    gpgme_initialized = true;
+  }
+
+  release_gpgme_contexts();
+  ctx = create_gpgme_context();
+  return ctx != NULL;
+}
+
+gpgme_ctx_t update_engine::create_gpgme_context()
+{
+  gpgme_ctx_t c;
+  gpg_error_t err = gpgme_new(&c);
+  if (err)
+  {
+    printf("Failed to create context: %s\n", gpg_strerror(err));
+    return NULL;
+  }
+  err = gpgme_ctx_set_engine_info(c, GPGME_PROTOCOL_OpenPGP, NULL, gpg_home.string().c_str());
+  if (err)
+  {
+    printf("Failed to set GPG home directory: %s\n", gpg_strerror(err));
+    gpgme_release(c);
+    return NULL;
+  }
+  return c;
+}
+
+// contexts all share the keyring in gpg_home, and each can run a verification
+// independently of the others
+gpgme_ctx_t update_engine::acquire_verify_context()
+{
+  {
+    boost::unique_lock<boost::mutex> lock(verify_contexts_mutex);
+    if (!verify_contexts.empty())
+    {
+      gpgme_ctx_t c = verify_contexts.back();
+      verify_contexts.pop_back();
+      return c;
+    }
+  }
+  return create_gpgme_context();
+}
+
+void update_engine::release_verify_context(gpgme_ctx_t c)
+{
+  boost::unique_lock<boost::mutex> lock(verify_contexts_mutex);
+  verify_contexts.push_back(c);
+}
+
+void update_engine::release_gpgme_contexts()
+{
+  boost::unique_lock<boost::mutex> lock(verify_contexts_mutex);
+  for (gpgme_ctx_t c: verify_contexts)
+    gpgme_release(c);
+  verify_contexts.clear();
+  if (ctx)
+  {
+    gpgme_release(ctx);
+    ctx = NULL;
+  }
+}
+
+// identifies the embedded key set, so a cached keyring is rebuilt whenever it changes
+static std::string get_keyring_id()
+{
+  tools::sha256_hasher hasher;
+  for (const auto &e: pubkeys)
+  {
+    const uint64_t sizes[2] = { e.first.size(), e.second.size() };
+    hasher.update(sizes, sizeof(sizes));
+    hasher.update(e.first.data(), e.first.size());
+    hasher.update(e.second.data(), e.second.size());
+  }
+  uint8_t hash[32];
+  hasher.finalize(hash);
+  return hash_to_hex(hash);
+}
+
+static bool load_keyring_manifest(const boost::filesystem::path &path, std::map<std::string, std::string> &fingerprints)
+{
+  std::ifstream f(path.string());
+  if (!f.good())
+    return false;
+  std::string line;
+  fingerprints.clear();
+  while (std::getline(f, line))
+  {
+    const size_t sep = line.find(' ');
+    if (sep == 0 || sep == std::string::npos || sep + 1 == line.size())
+      return false;
+    fingerprints[line.substr(0, sep)] = line.substr(sep + 1);
+  }
+  return fingerprints.size() == pubkeys.size();
+}
+
+static bool save_keyring_manifest(const boost::filesystem::path &path, const std::map<std::string, std::string> &fingerprints)
+{
+  std::ofstream f(path.string(), std::ios_base::out | std::ios_base::trunc);
+  for (const auto &e: fingerprints)
+    f << e.first << " " << e.second << "\n";
+  f.close();
+  return f.good();
+}
+
+tristate_t update_engine::verify_gitian_signature(gpgme_ctx_t c, const std::string &contents, const std::string &signature, std::string &fingerprint)
+{
+  gpgme_data_t contents_data, signature_data;
+  gpg_error_t err;
+
+  err = gpgme_data_new_from_mem(&contents_data, contents.data(), contents.size(), 0);
+  if (err)
+  {
+    printf("Failed to create contents data: %s\n", gpg_strerror(err));
+    return TriUnknown;
+  }
+  err = gpgme_data_new_from_mem(&signature_data, signature.data(), signature.size(), 0);
+  if (err)
+  {
+    printf("Failed to create signature data: %s\n", gpg_strerror(err));
+    return TriUnknown;
+  }
+
+  err = gpgme_op_verify(c, signature_data, contents_data, NULL);
+  gpgme_data_release(signature_data);
+  gpgme_data_release(contents_data);
+  if (err)
+  {
+    printf("Failed to verify signature: %s\n", gpg_strerror(err));
+    return TriFalse;
+  }
+  gpgme_verify_result_t result = gpgme_op_verify_result(c);
+  if (!result || !result->signatures)
+  {
+    printf("Failed to get signature verification results\n");
+    return TriFalse;
+  }
+  fingerprint = result->signatures->fpr;
+  if (result->signatures->status)
+  {
+    printf("Cannot check signature\n");
+    return TriUnknown;
+  }
+  if (result->signatures->summary & GPGME_SIGSUM_RED)
+  {
+    printf("Red signature\n");
+    return TriFalse;
+  }
+  if (result->signatures->summary & GPGME_SIGSUM_VALID)
+  {
+    printf("Valid signature\n");
+    return TriTrue;
+  }
+
+#if 0
+  printf("SIG:\n");
+  printf("valid: %d\n", result->signatures->summary & GPGME_SIGSUM_VALID);
+  printf("green: %d\n", result->signatures->summary & GPGME_SIGSUM_GREEN);
+  printf("red: %d\n", result->signatures->summary & GPGME_SIGSUM_RED);
+  printf("sys-error: %d\n", result->signatures->summary & GPGME_SIGSUM_SYS_ERROR);
+  printf("tofu: %d\n", result->signatures->summary & GPGME_SIGSUM_TOFU_CONFLICT);
+  printf("full: %x\n", result->signatures->summary);
+  printf("status: %x (%s)\n", result->signatures->status, gpgme_strerror(result->signatures->status));
+  printf("validity: %x\n", result->signatures->validity);
+  printf("validity_reason: %x (%s)\n", result->signatures->validity_reason, gpgme_strerror(result->signatures->validity_reason));
+#endif
+
+  return TriTrue;
+}
+
+bool update_engine::import_pubkeys_into_keyring()
+{
+  gpg_error_t err;
+
+  for (const auto &e: pubkeys)
+  {
+    gpgme_data_t pubkey_data;
+
+    err = gpgme_data_new_from_mem(&pubkey_data, e.second.data(), e.second.size(), 0);
+    if (err)
+    {
+      printf("Failed to create pubkey data: %s\n", gpg_strerror(err));
+      return false;
+    }
+    err = gpgme_op_import(ctx, pubkey_data);
+    gpgme_data_release(pubkey_data);
+    if (err)
+    {
+      printf("Failed to import pubkey: %s\n", gpg_strerror(err));
+      return false;
+    }
+    const gpgme_import_result_t result = gpgme_op_import_result(ctx);
+    if (!result || !result->imports || !result->imports->fpr || result->imports->result)
+    {
+      printf("Failed to get results of pubkey import\n");
+      return false;
+    }
+    const std::string fingerprint = result->imports->fpr;
+    gpgme_key_t key;
+    err = gpgme_get_key(ctx, fingerprint.c_str(), &key, 0);
+    if (err)
+    {
+      printf("Failed to get imported pubkey");
+      return false;
+    }
+    err = gpgme_op_tofu_policy(ctx, key, GPGME_TOFU_POLICY_GOOD);
+    gpgme_key_release(key);
+    if (err)
+    {
+      printf("Failed to set trust policy: %s\n", gpg_strerror(err));
+      return false;
+    }
+
+    boost::unique_lock<boost::mutex> lock(mutex);
+    add_message("Imported key " + fingerprint + " from " + e.first);
+    imported_fingerprints[fingerprint] = e.first;
+  }
+  return true;
+}
+
+// fingerprints of the embedded keys, read from the keys themselves rather than a keyring
+bool update_engine::get_pubkey_fingerprints(std::map<std::string, std::string> &fingerprints)
+{
+  gpg_error_t err;
+
+  fingerprints.clear();
+  for (const auto &e: pubkeys)
+  {
+    gpgme_data_t pubkey_data;
+
+    err = gpgme_data_new_from_mem(&pubkey_data, e.second.data(), e.second.size(), 0);
+    if (err)
+    {
+      printf("Failed to create pubkey data: %s\n", gpg_strerror(err));
+      return false;
+    }
+    gpgme_key_t key = NULL;
+    err = gpgme_op_keylist_from_data_start(ctx, pubkey_data, 0);
+    if (!err)
+      err = gpgme_op_keylist_next(ctx, &key);
+    gpgme_op_keylist_end(ctx);
+    gpgme_data_release(pubkey_data);
+    if (err || !key->subkeys || !key->subkeys->fpr)
+    {
+      printf("Failed to read pubkey from %s\n", e.first.c_str());
+      if (!err)
+        gpgme_key_release(key);
+      return false;
+    }
+    fingerprints[key->subkeys->fpr] = e.first;
+    gpgme_key_release(key);
+  }
+  return true;
+}
+
+// a cached keyring is only used if it has all of the embedded keys, and its
+// manifest lists those and nothing else
+bool update_engine::check_cached_keyring(const std::map<std::string, std::string> &fingerprints)
+{
+  std::map<std::string, std::string> expected;
+  if (!get_pubkey_fingerprints(expected))
+    return false;
+  if (fingerprints != expected)
+  {
+    MWARNING("Cached keyring manifest does not match the embedded keys");
+    return false;
+  }
+  for (const auto &e: expected)
+  {
+    gpgme_key_t key;
+    if (gpgme_get_key(ctx, e.first.c_str(), &key, 0))
+    {
+      MWARNING("Key " << e.first << " from " << e.second << " is missing from the cached keyring");
+      return false;
+    }
+    gpgme_key_release(key);
+  }
+  return true;
+}
+
+bool update_engine::open_keyring_cache(const boost::filesystem::path &cache_dir)
+{
+  const std::string keyring_name = "keyring-" + get_keyring_id();
+  const boost::filesystem::path keyring_path = cache_dir / keyring_name;
+  boost::system::error_code ec;
+
+  std::map<std::string, std::string> fingerprints;
+  if (load_keyring_manifest(keyring_path / KEYRING_MANIFEST, fingerprints))
+  {
+    if (!is_private_directory(keyring_path))
+    {
+      MWARNING("Cached keyring " << keyring_path << " is not private to this user, rebuilding it");
+    }
+    else
+    {
+      gpg_home = keyring_path;
+      gpg_home_persistent = true;
+      if (init_gpgme() && check_cached_keyring(fingerprints))
+      {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        imported_fingerprints = fingerprints;
+        add_message("Using cached keyring with " + std::to_string(fingerprints.size()) + " keys");
+        return true;
+      }
+      MWARNING("Rebuilding cached keyring " << keyring_path);
+    }
+  }
+
+  // build the keyring next to its final location, and only move it in place once complete,
+  // so an interrupted build never leaves a keyring that looks valid
+  MINFO("Building keyring cache in " << keyring_path);
+  gpg_home = cache_dir / (keyring_name + "-" + boost::filesystem::unique_path("%%%%-%%%%").string());
+  gpg_home_persistent = false;
+  if (!create_private_directory(gpg_home) || !init_gpgme() || !import_pubkeys_into_keyring())
+  {
+    boost::filesystem::remove_all(gpg_home, ec);
+    return false;
+  }
+  {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    fingerprints = imported_fingerprints;
+  }
+  if (!save_keyring_manifest(gpg_home / KEYRING_MANIFEST, fingerprints))
+  {
+    MWARNING("Failed to write keyring manifest, not caching keyring");
+    return true;
+  }
+
+  boost::filesystem::remove_all(keyring_path, ec);
+  boost::filesystem::rename(gpg_home, keyring_path, ec);
+  if (ec)
+  {
+    // most likely another instance got there first, keep using ours for this run
+    MWARNING("Failed to move keyring to " << keyring_path << ": " << ec.message());
+    return true;
+  }
+  gpg_home = keyring_path;
+  gpg_home_persistent = true;
+  if (!init_gpgme())
+    return false;
+
+  // keyrings for other key sets are no longer useful
+  for (boost::filesystem::directory_iterator i(cache_dir, ec), end; !ec && i != end; i.increment(ec))
+  {
+    const std::string name = i->path().filename().string();
+    if (name != keyring_name && name.size() == keyring_name.size() && name.compare(0, 8, "keyring-") == 0)
+    {
+      MINFO("Removing stale keyring " << i->path());
+      boost::system::error_code rec;
+      boost::filesystem::remove_all(i->path(), rec);
+    }
+  }
+  return true;
+}
+
+void update_engine::import_pubkeys()
+{
+  boost::unique_lock<boost::mutex> lock(mutex);
+
+  gitian_pubkeys_import_done = false;
+  gitian_pubkeys_import_success = false;
+  imported_fingerprints.clear();
+  boost::filesystem::path cache_dir = keyring_cache_dir;
+  lock.unlock();
+
+  // anyone else who can write to the cache could swap keys in it
+  if (!cache_dir.empty() && (!create_private_directory(cache_dir) || !is_private_directory(cache_dir)))
+  {
+    lock.lock();
+    add_message("Keyring cache directory " + cache_dir.string() + " is not private to this user, not caching keyring");
+    lock.unlock();
+    cache_dir.clear();
+  }
+
+  bool success;
+  if (cache_dir.empty())
+  {
+    gpg_home = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("%%%%-%%%%-%%%%-%%%%");
+    gpg_home_persistent = false;
+    success = create_private_directory(gpg_home) && init_gpgme();
+    if (!success)
+    {
+      lock.lock();
+      add_message("Failed to initialize GPG");
+      lock.unlock();
+    }
+    else
+    {
+      success = import_pubkeys_into_keyring();
+    }
+  }
+  else
+  {
+    success = open_keyring_cache(cache_dir);
+  }
+
+  lock.lock();
+  gitian_pubkeys_import_done = true;
+  gitian_pubkeys_import_success = success;
+}
+
+// downloads into memory, as one of our own downloads so shutting down can cancel it
+bool update_engine::fetch_to_buffer(const std::string &url, std::string &buffer, size_t max_size, std::chrono::steady_clock::time_point deadline)
+{
+  bool success = false;
+  tools::download_async_handle handle;
+  {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (!running)
+      return false;
+    handle = tools::download_to_buffer_async(url, buffer, max_size, [&success](const std::string&, const std::string&, bool result) { success = result; }, deadline);
+    buffer_downloads.insert(handle);
+  }
+  tools::download_wait(handle);
+  boost::unique_lock<boost::mutex> lock(mutex);
+  buffer_downloads.erase(handle);
+  return success;
+}
+
+void update_engine::fetch_gitian_sigs()
+{
+  boost::unique_lock<boost::mutex> lock(mutex);
+
+  gitian_verify_sigs_success = false;
+  gitian_verify_sigs_success = false;
+
+  set_total_gitian_sigs(0);
+  set_processed_gitian_sigs(0);
+
+  std::string platform = buildtag;
+  auto idx = platform.find('-');
+  if (idx != std::string::npos)
+    platform = platform.substr(0, idx);
+  auto it = platform_to_gitian.find(platform);
+  if (it != platform_to_gitian.end())
+    platform = it->second;
+  std::string base_tree_url_path = "/monero-project/gitian.sigs/tree/master/v" + version + "-" + platform;
+  std::string base_blob_url_path = "/monero-project/gitian.sigs/master/v" + version + "-" + platform;
+  std::string base_tree_url = "https://github.com" + base_tree_url_path;
+  std::string base_blob_url = "https://raw.githubusercontent.com" + base_blob_url_path;
+  add_message("Fetching Gitian signatures from " + base_tree_url);
+  lock.unlock();
+  // one budget for the whole fetch, so a slow server can not hold verification up for long
+  const std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::seconds(GITIAN_FETCH_TIMEOUT);
+  std::string s;
+  if (!fetch_to_buffer(base_tree_url, s, MAX_GITIAN_TREE_SIZE, deadline))
+  {
+    lock.lock();
+    add_message("Gitian signatures not found");
+    set_valid_gitian_sigs(0);
+    gitian_verify_sigs_done = true;
+    gitian_verify_sigs_success = false;
+    lock.unlock();
+    set_state(StateNoGitianSigs);
+    return;
+  }
+
+  const std::string subdir = strstr(buildtag.c_str(), "-source") ? "source" : strstr(software.c_str(), "-gui") ? "" : "cli";
+  it = dnssec_to_gitian.find(buildtag);
+  const std::string gitian_tag = it == dnssec_to_gitian.end() ? buildtag : it->second;
+  const std::string url = tools::get_update_url(software, subdir, gitian_tag, version, false);
+  std::string filename = boost::filesystem::path(url).filename().string();
+
+  std::string expression = "([abcdefABCDEF0123456789]+)  " + filename + "$";
+  STATIC_REGEXP_EXPR_1(rexp_match_hash_and_filename, expression, boost::regex::normal);
+
+  set_valid_gitian_sigs(0);
+  set_min_valid_gitian_sigs(MIN_GITIAN_SIGS);
+  bool bad_signature_found = false;
+  std::vector<std::string> users;
+  idx = 0;
+  std::string link_prefix = "href=\"" + base_tree_url_path;
+  while (1)
+  {
+    idx = s.find(link_prefix, idx);
+    if (idx == std::string::npos)
+      break;
+    auto idx2 = s.find("\"", idx + link_prefix.size());
+    if (idx2 == std::string::npos || idx2 + 2 >= s.size())
+      break;
+    std::string user = s.substr(idx + link_prefix.size() + 1 , idx2 - idx - link_prefix.size() - 1);
+    idx = idx2;
+    if (user.size() > 20 || strspn(user.c_str(), "abcdefghijlkmnopqrstuvwxyzABCDEFGHIJLKMNOPQRSTUVWXYZ_-0123456789") != user.size())
+      continue;
+    users.push_back(std::move(user));
+  }
+
+  if (users.empty())
+  {
+    lock.lock();
+  gitian_verify_sigs_done = true;
+  gitian_verify_sigs_success = false;
+    add_message("No Gitian signatures found");
+    lock.unlock();
+    set_state(StateNoGitianSigs);
+    return;
+  }
+
+  set_state(StateVerifyGitianSignatures);
+  set_total_gitian_sigs(users.size());
+
+  struct gitian_sig_result
+  {
+    bool fetched;
+    tristate_t res;
+    std::string fingerprint;
+    std::string assert_contents;
+  };
+  std::vector<gitian_sig_result> results(users.size(), {false, TriUnknown, "", ""});
+
+  // fetch (and verify) a bounded number of signers at a time, results are
+  // merged in signer order once they are all in
+  lock.lock();
+  const unsigned int concurrency = std::max<size_t>(1, std::min<size_t>(gitian_fetch_concurrency, users.size()));
+  lock.unlock();
+  std::atomic<size_t> next_user(0);
+  tools::threadpool& tpool = tools::threadpool::getInstance();
+  tools::threadpool::waiter waiter;
+  for (unsigned int n = 0; n < concurrency; ++n)
+  {
+    tpool.submit(&waiter, [&, this]() {
+      while (1)
+      {
+        {
+          boost::unique_lock<boost::mutex> lock(mutex);
+          if (!running)
+            break;
+        }
+        const size_t idx = next_user++;
+        if (idx >= users.size())
+          break;
+        const std::string &user = users[idx];
+        std::string short_version = version.substr(0, 4);
+        std::string assert_url = base_blob_url + "/" + user + "/" + software + "-" + platform + "-" + short_version + "-build.assert";
+        std::string sig_url = base_blob_url + "/" + user + "/" + software + "-" + platform + "-" + short_version + "-build.assert.sig";
+        std::string sig_contents;
+        if (fetch_to_buffer(assert_url, results[idx].assert_contents, MAX_GITIAN_FILE_SIZE, deadline))
+        {
+          if (fetch_to_buffer(sig_url, sig_contents, MAX_GITIAN_FILE_SIZE, deadline))
+          {
+            // each worker verifies with its own context, so gpg runs in parallel
+            gpgme_ctx_t c = acquire_verify_context();
+            if (c)
+            {
+              results[idx].res = verify_gitian_signature(c, results[idx].assert_contents, sig_contents, results[idx].fingerprint);
+              results[idx].fetched = true;
+              release_verify_context(c);
+            }
+            else
+            {
+              boost::unique_lock<boost::mutex> lock(mutex);
+              add_message("Failed to create GPG context to verify " + sig_url);
+            }
+          }
+          else
+          {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            add_message("Failed to fetch " + sig_url);
+          }
+        }
+        else
+        {
+          boost::unique_lock<boost::mutex> lock(mutex);
+          add_message("Failed to fetch " + assert_url);
+        }
+        boost::unique_lock<boost::mutex> lock(mutex);
+        set_processed_gitian_sigs(processed_gitian_sigs + 1);
+      }
+    });
+  }
+  waiter.wait(&tpool);
+
+  const tools::download_pool_stats stats = tools::get_download_pool_stats();
+  MINFO("Gitian signatures fetched, " << stats.hits << "/" << (stats.hits + stats.misses) << " requests on reused connections, "
+      << stats.tls_resumed << "/" << stats.tls_handshakes << " TLS handshakes resumed");
+
+  std::map<std::string, std::string> fingerprints;
+  for (size_t n = 0; n < users.size(); ++n)
+  {
+    const std::string &user = users[n];
+    const gitian_sig_result &sig = results[n];
+    if (!sig.fetched)
+      continue;
+    const tristate_t res = sig.res;
+    const std::string &fingerprint = sig.fingerprint;
+    const auto it = fingerprints.find(fingerprint);
+    if (res == TriTrue && it == fingerprints.end() && imported_fingerprints.find(fingerprint) != imported_fingerprints.end())
+    {
+      bool found = false;
+      std::string hash;
+      std::vector<std::string> lines;
+      boost::split(lines, sig.assert_contents, boost::is_any_of("\n"));
+      for (const auto &line: lines)
+      {
+        boost::smatch result;
+        if (boost::regex_search(line, result, rexp_match_hash_and_filename, boost::match_default) && result[0].matched)
+        {
+          hash = result[1];
+          found = true;
+        }
+      }
+      if (!found)
+      {
+        lock.lock();
+        add_message("No hash found in Gitian assert file for " + filename + " from " + user);
+        lock.unlock();
+      }
+      else if (hash != expected_hash)
+      {
+        lock.lock();
+        add_message("Gitian hash does not match expected hash for " + filename + " from " + user);
+        lock.unlock();
+      }
+      else
+      {
+        lock.lock();
+        add_message("Good Gitian signature with matching hash from " + user + ", fingerprint " + fingerprint);
+        set_valid_gitian_sigs(valid_gitian_sigs + 1);
+        lock.unlock();
+        fingerprints.insert(std::make_pair(fingerprint, user));
+      }
+    }
+    else if (res == TriTrue && it == fingerprints.end() && imported_fingerprints.find(fingerprint) == imported_fingerprints.end())
+    {
+      lock.lock();
+      add_message("Valid Gitian signature from " + user + ", but from key " + fingerprint + " which is not the one on record");
+      lock.unlock();
+    }
+    else if (res == TriTrue && it != fingerprints.end())
+    {
+      lock.lock();
+      add_message("Duplicate Gitian signature from " + user + ", previously seen from " + it->second + ", fingerprint " + fingerprint);
+      lock.unlock();
+    }
+    else if (res == TriFalse)
+    {
+      lock.lock();
+      add_message("Bad Gitian signature from " + user);
+      lock.unlock();
+      bad_signature_found = true;
+    }
+    else
+    {
+      lock.lock();
+      add_message("Inconclusive Gitian signature from " + user + ", fingerprint " + fingerprint);
+      lock.unlock();
+    }
+  }
+  if (!gpg_home_persistent)
+  {
+    boost::system::error_code ec;
+    boost::filesystem::remove_all(gpg_home.string(), ec);
+  }
+  lock.lock();
+  gitian_verify_sigs_done = true;
+  gitian_verify_sigs_success = valid_gitian_sigs >= MIN_GITIAN_SIGS && !bad_signature_found;
+}
+
+void update_engine::add_message(const std::string &s)
+{
+  MINFO("Message: " << s);
+  messages.push_back(s);
+  listener.on_message(s);
+}
+
+void update_engine::wake_up()
+{
+  boost::unique_lock<boost::mutex> lock(mutex);
+  event_pending = true;
+  cond.notify_one();
+}
+
+void update_engine::updater_thread()
+{
+  while (1)
+  {
+    {
+      boost::unique_lock<boost::mutex> lock(mutex);
+      while (running && !event_pending)
+        cond.wait(lock);
+      if (!running)
+        break;
+      event_pending = false;
+    }
+
+    switch (state)
+    {
+    case StateInit:
+      set_state(StateQueryDNS);
+      break;
+    case StateQueryDNS:
+      if (!dns_query_done)
+        break;
+      if (good_dns_records.empty())
+        set_state(StateDNSFailed);
+      else
+        set_state(StateCheckVersion);
+      break;
+    case StateCheckVersion:
+      if (!version_check_done)
+        break;
+      if (version.empty())
+        set_state(StateNoUpdateInfoFound);
+      else
+      {
+        int cmp = tools::vercmp(version.c_str(), current_version.c_str());
+        if (cmp > 0)
+        {
+          // we know the version and expected hash now, so the download can
+          // run while the Gitian signatures are being checked
+          if (pipelined_download)
+            start_download();
+          set_state(StateImportPubkeys);
+        }
+        else if (cmp < 0)
+          set_state(StateBackInTime);
+        else
+          set_state(StateUpToDate);
+      }
+      break;
+    case StateImportPubkeys:
+      if (!gitian_pubkeys_import_done)
+        break;
+      if (gitian_pubkeys_import_success)
+        set_state(StateFetchGitianSigs);
+      else
+        set_state(StatePubkeyImportFailed);
+      break;
+    case StateVerifyGitianSignatures:
+      if (!gitian_verify_sigs_done)
+        break;
+      if (gitian_verify_sigs_success)
+        set_state(StateDownload);
+      else if (valid_gitian_sigs > 0)
+        set_state(StateNotEnoughGitianSigs);
+      else
+        set_state(StateBadGitianSigs);
+      break;
+    case StateDownload:
+      if (!download_done)
+        break;
+      if (download_success)
+        set_state(StateCheckHash);
+      else
+        set_state(StateDownloadFailed);
+      break;
+    case StateCheckHash:
+      if (hash_valid == TriTrue)
+        set_state(StateValidUpdate);
+      else if (hash_valid == TriFalse)
+        set_state(StateBadHash);
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+void update_engine::set_state(State s)
+{
+  {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    const auto now = std::chrono::steady_clock::now();
+    const auto since_last = std::chrono::duration_cast<std::chrono::milliseconds>(now - last_transition_time).count();
+    const auto since_start = std::chrono::duration_cast<std::chrono::milliseconds>(now - start_time).count();
+    MINFO("State " << get_state_name(state) << " -> " << get_state_name(s) << " after " << since_last << " ms (" << since_start << " ms since start)");
+    last_transition_time = now;
+    state = s;
+  }
+  listener.on_state_changed(s, get_state_name(s), get_outcome(s));
+  switch (state)
+  {
+    case StateInit:
+      dns_query_done = false;
+      version_check_done = false;
+      set_dns_valid(TriUnknown);
+      set_hash_valid(TriUnknown);
+      set_valid_gitian_sigs(0);
+      set_min_valid_gitian_sigs(0);
+      break;
+    case StateQueryDNS:
+      load_txt_records_from_dns(dns_urls, dns_query_results, good_dns_records);
+      break;
+    case StateCheckVersion:
+      process_version(software, buildtag, good_dns_records);
+      break;
+    case StateDownload:
+      if (!download_started)
+        start_download();
+      break;
+    case StatePubkeyImportFailed:
+    case StateNoGitianSigs:
+    case StateNotEnoughGitianSigs:
+    case StateBadGitianSigs:
+      abort_download();
+      break;
+    case StateCheckHash:
+      check_hash();
+      break;
+    case StateImportPubkeys:
+      import_pubkeys();
+      break;
+    case StateFetchGitianSigs:
+      fetch_gitian_sigs();
+      break;
+    default:
+      break;
+  }
+
+  // the work for most states is done synchronously above, so let the state
+  // machine look at the outcome right away rather than on the next event
+  wake_up();
+}
+
+std::string update_engine::get_state() const
+{
+  boost::unique_lock<boost::mutex> lock(mutex);
+  return get_state_name(state);
+}
+
+tristate_t update_engine::get_state_outcome() const
+{
+  boost::unique_lock<boost::mutex> lock(mutex);
+  return get_outcome(state);
+}
+
+std::string update_engine::get_version() const
+{
+  boost::unique_lock<boost::mutex> lock(mutex);
+  return version;
+}
+
+tristate_t update_engine::get_dns_valid() const
+{
+  boost::unique_lock<boost::mutex> lock(mutex);
+  return dns_valid;
+}
+
+tristate_t update_engine::get_hash_valid() const
+{
+  boost::unique_lock<boost::mutex> lock(mutex);
+  return hash_valid;
+}
+
+uint32_t update_engine::get_valid_gitian_sigs() const
+{
+  boost::unique_lock<boost::mutex> lock(mutex);
+  return valid_gitian_sigs;
+}
+
+uint32_t update_engine::get_min_valid_gitian_sigs() const
+{
+  return min_valid_gitian_sigs;
+}
+
+uint32_t update_engine::get_processed_gitian_sigs() const
+{
+  return processed_gitian_sigs;
+}
+
+uint32_t update_engine::get_total_gitian_sigs() const
+{
+  return total_gitian_sigs;
+}
+
+const char *update_engine::get_state_name(State state)
+{
+  return states[state].second;
+}
@@ -0,0 +1,243 @@
+/*  monero-update - An downloaded/checker updater for Monero
+ *
+ *  Copyright (c) 2019, The Monero Project
+ *
+ *  All rights reserved.
+ *  
+ *  monero-update is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  monero-update is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with monero-update.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <boost/thread.hpp>
+#include <boost/filesystem.hpp>
+#include <gpgme.h>
+#include "common/download.h"
+
+enum tristate_t
+{
+  TriUnknown,
+  TriTrue,
+  TriFalse
+};
+
+enum State
+{
+  StateNone,
+  StateInit,
+  StateQueryDNS,
+  StateDNSFailed,
+  StateCheckVersion,
+  StateUpToDate,
+  StateBackInTime,
+  StateNoUpdateInfoFound,
+  StateDownload,
+  StateDownloadFailed,
+  StateCheckHash,
+  StateBadHash,
+  StateFetchGitianSigs,
+  StateImportPubkeys,
+  StatePubkeyImportFailed,
+  StateVerifyGitianSignatures,
+  StateNoGitianSigs,
+  StateNotEnoughGitianSigs,
+  StateBadGitianSigs,
+  StateValidUpdate,
+};
+
+struct dns_query_result_t
+{
+  bool avail;
+  bool valid;
+  std::vector<std::string> records;
+};
+
+// where the update download is at, see update_engine::get_download_progress
+struct download_progress_t
+{
+  uint64_t downloaded;
+  uint64_t total;     // 0 until it is known
+  uint64_t rate;      // bytes per second, smoothed over the last few seconds
+  int64_t eta;        // seconds left, -1 if not known
+};
+
+// Notifications from the update engine. These are called from the engine's
+// own threads, sometimes with its lock held, so they must not call back into
+// the engine.
+class update_listener
+{
+public:
+  virtual ~update_listener() {}
+
+  virtual void on_state_changed(State state, const char *name, tristate_t outcome) {}
+  virtual void on_version_changed(const std::string &version) {}
+  virtual void on_dns_valid_changed(tristate_t dns_valid) {}
+  virtual void on_hash_valid_changed(tristate_t hash_valid) {}
+  virtual void on_valid_gitian_sigs_changed(uint32_t sigs) {}
+  virtual void on_min_valid_gitian_sigs_changed(uint32_t sigs) {}
+  virtual void on_total_gitian_sigs_changed(uint32_t sigs) {}
+  virtual void on_processed_gitian_sigs_changed(uint32_t sigs) {}
+  virtual void on_message(const std::string &s) {}
+  virtual void on_download_started() {}
+  virtual void on_download_finished(bool success) {}
+  virtual void on_valid_update_ready(const std::string &filename) {}
+};
+
+// The DNS check, download and Gitian verification state machine, independent
+// of any UI. Final states have an outcome other than TriUnknown.
+class update_engine
+{
+public:
+  update_engine(update_listener &listener);
+  ~update_engine();
+
+  //! starts the state machine, configuration must be set before this
+  void start();
+
+  std::string get_state() const;
+  std::string get_version() const;
+  tristate_t get_dns_valid() const;
+  tristate_t get_hash_valid() const;
+  uint32_t get_valid_gitian_sigs() const;
+  uint32_t get_min_valid_gitian_sigs() const;
+  uint32_t get_total_gitian_sigs() const;
+  uint32_t get_processed_gitian_sigs() const;
+  tristate_t get_state_outcome() const;
+
+  void retry_download();
+  //! how the last update download started is getting on, false if none was. This only
+  //! reads counters the download keeps as it goes, and is meant to be polled a few times
+  //! a second: each call is a sample for the rate estimate.
+  bool get_download_progress(download_progress_t &progress);
+
+  void set_gitian_fetch_concurrency(unsigned int concurrency);
+  //! keep the imported Gitian keyring in this directory across runs, empty for a throwaway keyring
+  void set_keyring_cache_dir(const std::string &dir);
+  //! base URLs of mirrors of the download site, raced against it for the update
+  void set_mirrors(const std::vector<std::string> &mirrors);
+  //! keep the update being downloaded in this directory, so a later run can carry on
+  //! from where this one stopped, empty for a throwaway temporary file
+  void set_download_dir(const std::string &dir);
+  //! only download the update at full speed while nothing else uses the network
+  void set_download_idle_only(bool idle_only);
+  //! download the update no faster than this, in bytes per second, 0 for no limit. All
+  //! downloads together are limited by tools::set_download_rate_limit instead
+  void set_download_rate_limit(uint64_t bytes_per_second);
+  //! give up on the update download after this many seconds, 0 for never. Each retry
+  //! gets as long again
+  void set_download_timeout(unsigned int seconds);
+
+  static const char *get_state_name(State state);
+
+private:
+  void updater_thread();
+  void wake_up();
+  void set_state(State s);
+  void set_dns_valid(tristate_t t);
+  void set_hash_valid(tristate_t t);
+  void set_valid_gitian_sigs(uint32_t sigs);
+  void set_min_valid_gitian_sigs(uint32_t sigs);
+  void set_total_gitian_sigs(uint32_t sigs);
+  void set_processed_gitian_sigs(uint32_t sigs);
+
+  void add_message(const std::string &s);
+  void load_txt_records_from_dns(const std::vector<std::string> &dns_urls, std::vector<dns_query_result_t> &results, std::vector<std::string> &good_records);
+  void process_version(const std::string &software, const std::string &buildtag, const std::vector<std::string> &records);
+  void start_download();
+  void abort_download(bool keep_partial = false);
+  void check_hash();
+  bool init_gpgme();
+  gpgme_ctx_t create_gpgme_context();
+  gpgme_ctx_t acquire_verify_context();
+  void release_verify_context(gpgme_ctx_t c);
+  void release_gpgme_contexts();
+  void import_pubkeys();
+  bool import_pubkeys_into_keyring();
+  bool get_pubkey_fingerprints(std::map<std::string, std::string> &fingerprints);
+  bool check_cached_keyring(const std::map<std::string, std::string> &fingerprints);
+  bool open_keyring_cache(const boost::filesystem::path &cache_dir);
+  bool fetch_to_buffer(const std::string &url, std::string &buffer, size_t max_size, std::chrono::steady_clock::time_point deadline);
+  void fetch_gitian_sigs();
+  tristate_t verify_gitian_signature(gpgme_ctx_t c, const std::string &contents, const std::string &signature, std::string &fingerprint);
+
+  update_listener &listener;
+  bool running;
+  mutable boost::mutex mutex;
+  boost::condition_variable cond;
+  boost::thread thread;
+
+  State state;
+  bool event_pending;
+  std::chrono::steady_clock::time_point start_time;
+  std::chrono::steady_clock::time_point last_transition_time;
+  std::vector<dns_query_result_t> dns_query_results;
+  std::vector<std::string> good_dns_records;
+  std::vector<std::string> messages;
+
+  std::string version;
+  std::string expected_hash;
+  std::string downloaded_hash;
+  tristate_t dns_valid;
+  tristate_t hash_valid;
+  uint32_t valid_gitian_sigs;
+  uint32_t min_valid_gitian_sigs;
+  uint32_t total_gitian_sigs;
+  uint32_t processed_gitian_sigs;
+
+  std::string software;
+  std::string buildtag;
+  std::string current_version;
+
+  bool pipelined_download;
+  unsigned int gitian_fetch_concurrency;
+  std::vector<std::string> mirrors;
+
+  bool dns_query_done;
+  bool version_check_done;
+  bool download_started;
+  bool download_done;
+  bool download_success;
+  bool gitian_pubkeys_import_done;
+  bool gitian_pubkeys_import_success;
+  bool gitian_verify_sigs_done;
+  bool gitian_verify_sigs_success;
+
+  boost::filesystem::path download_dir;
+  boost::filesystem::path download_path;
+  boost::filesystem::path quarantine_path;
+  bool download_resumable;
+  bool download_idle_only;
+  uint64_t download_rate_limit;
+  unsigned int download_timeout; // seconds
+  tools::download_async_handle download_handle;
+  tools::download_async_handle progress_handle; // kept after the download is done
+  std::set<tools::download_async_handle> buffer_downloads; // Gitian signatures in flight
+  std::chrono::steady_clock::time_point progress_time;
+  uint64_t progress_received;
+  double download_rate;
+  boost::filesystem::path gpg_home;
+  boost::filesystem::path keyring_cache_dir;
+  bool gpg_home_persistent;
+
+  gpgme_ctx_t ctx;
+  std::vector<gpgme_ctx_t> verify_contexts;
+  boost::mutex verify_contexts_mutex;
+
+  std::map<std::string, std::string> imported_fingerprints;
+};
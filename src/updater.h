@@ -20,58 +20,24 @@
 
 #pragma once
 
-#include <functional>
-#include <tuple>
 #include <QObject>
-#include <boost/thread.hpp>
-#include <boost/filesystem.hpp>
-#include <gpgme.h>
-#include "common/download.h"
+#include <QTimer>
+#include "update_engine.h"
 
 namespace TriState
 {
   Q_NAMESPACE
   enum tristate_t
   {
-    TriUnknown,
-    TriTrue,
-    TriFalse
+    TriUnknown = ::TriUnknown,
+    TriTrue = ::TriTrue,
+    TriFalse = ::TriFalse
   };
   Q_ENUM_NS(tristate_t)
 };
 
-enum State
-{
-  StateNone,
-  StateInit,
-  StateQueryDNS,
-  StateDNSFailed,
-  StateCheckVersion,
-  StateUpToDate,
-  StateBackInTime,
-  StateNoUpdateInfoFound,
-  StateDownload,
-  StateDownloadFailed,
-  StateCheckHash,
-  StateBadHash,
-  StateFetchGitianSigs,
-  StateImportPubkeys,
-  StatePubkeyImportFailed,
-  StateVerifyGitianSignatures,
-  StateNoGitianSigs,
-  StateNotEnoughGitianSigs,
-  StateBadGitianSigs,
-  StateValidUpdate,
-};
-
-struct dns_query_result_t
-{
-  bool avail;
-  bool valid;
-  std::vector<std::string> records;
-};
-
-class Updater: public QObject
+// Qt front for update_engine, forwarding its notifications as signals
+class Updater: public QObject, private update_listener
 {
   Q_OBJECT
   Q_PROPERTY(QString state READ getState NOTIFY stateChanged)
@@ -103,24 +69,20 @@ public:
   Q_INVOKABLE void retryDownload();
 
 private:
-  void updater_thread();
-  void set_state(State s);
-  void setDnsValid(tristate_t t);
-  void setHashValid(tristate_t t);
-  void setValidGitianSigs(uint32_t sigs);
-  void setMinValidGitianSigs(uint32_t sigs);
-  void setTotalGitianSigs(uint32_t sigs);
-  void setProcessedGitianSigs(uint32_t sigs);
-
-  void add_message(const std::string &s);
-  void load_txt_records_from_dns(const std::vector<std::string> &dns_urls, std::vector<dns_query_result_t> &results, std::vector<std::string> &good_records);
-  void process_version(const std::string &software, const std::string &buildtag, const std::vector<std::string> &records);
-  void start_download();
-  void check_hash();
-  bool init_gpgme();
-  void import_pubkeys();
-  void fetch_gitian_sigs();
-  tristate_t verify_gitian_signature(const std::string &contents, const std::string &signature, std::string &fingerprint);
+  virtual void on_state_changed(State state, const char *name, ::tristate_t outcome);
+  virtual void on_version_changed(const std::string &version);
+  virtual void on_dns_valid_changed(::tristate_t dns_valid);
+  virtual void on_hash_valid_changed(::tristate_t hash_valid);
+  virtual void on_valid_gitian_sigs_changed(uint32_t sigs);
+  virtual void on_min_valid_gitian_sigs_changed(uint32_t sigs);
+  virtual void on_total_gitian_sigs_changed(uint32_t sigs);
+  virtual void on_processed_gitian_sigs_changed(uint32_t sigs);
+  virtual void on_message(const std::string &s);
+  virtual void on_download_started();
+  virtual void on_download_finished(bool success);
+  virtual void on_valid_update_ready(const std::string &filename);
+
+  void pollDownloadProgress();
 
 signals:
   void stateChanged(const QString &state);
@@ -133,49 +95,13 @@ signals:
   void processedGitianSigsChanged(uint32_t sigs);
   void stateOutcomeChanged(TriState::tristate_t stateOutcome);
   void message(const QString &s);
-  void downloadProgress(quint64 downloaded, quint64 total);
+  void downloadProgress(quint64 downloaded, quint64 total, quint64 rate, qint64 eta);
   void downloadStarted();
   void downloadFinished(bool success);
   void validUpdateReady(const QString &filename);
 
 private:
-  bool running;
-  mutable boost::mutex mutex;
-  boost::condition_variable cond;
-  boost::thread thread;
-
-  State state;
-  std::vector<dns_query_result_t> dns_query_results;
-  std::vector<std::string> good_dns_records;
-  std::vector<std::string> messages;
-
-  std::string version;
-  std::string expected_hash;
-  TriState::tristate_t dnsValid;
-  TriState::tristate_t hashValid;
-  uint32_t validGitianSigs;
-  uint32_t minValidGitianSigs;
-  uint32_t totalGitianSigs;
-  uint32_t processedGitianSigs;
-
-  std::string software;
-  std::string buildtag;
-  std::string current_version;
-
-  bool dns_query_done;
-  bool version_check_done;
-  bool download_done;
-  bool download_success;
-  bool gitian_pubkeys_import_done;
-  bool gitian_pubkeys_import_success;
-  bool gitian_verify_sigs_done;
-  bool gitian_verify_sigs_success;
-
-  boost::filesystem::path download_path;
-  tools::download_async_handle download_handle;
-  boost::filesystem::path gpg_home;
-
-  gpgme_ctx_t ctx;
-
-  std::map<std::string, std::string> imported_fingerprints;
+  QTimer progressTimer;
+  download_progress_t lastProgress;
+  update_engine engine;
 };